@@ -3,6 +3,7 @@
 //#include <volk.h>
 
 #include <meshoptimizer.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <vulkan/vulkan.h>
 
@@ -10,6 +11,9 @@
 #include <bitset>
 #include <cassert>
 #include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <vector>
 
@@ -30,6 +34,19 @@ string Cwd() {
     }
 }
 
+// Directory of the running executable, with trailing separator
+string ExecutableDir() {
+    char path[PATH_MAX];
+    const ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length <= 0) {
+        perror("readlink() error");
+        return "";
+    }
+    path[length] = '\0';
+    string dir = path;
+    return dir.substr(0, dir.find_last_of('/') + 1);
+}
+
 template <typename ArrayT>
 constexpr size_t size(const ArrayT& array) {
     return sizeof(array) / sizeof(array[0]);
@@ -85,6 +102,14 @@ VkSemaphore CreateSemaphore(VkDevice device) {
     return semaphore;
 }
 
+VkFence CreateFence(VkDevice device, VkFenceCreateFlags flags = 0) {
+    VkFenceCreateInfo info = {.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+                              .flags = flags};
+    VkFence fence = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateFence(device, &info, nullptr, &fence));
+    return fence;
+}
+
 VkBool32 DebugReportCallback(VkDebugReportFlagsEXT flags,
                              VkDebugReportObjectTypeEXT objectType,
                              uint64_t object, size_t location,
@@ -312,6 +337,48 @@ VkCommandPool CreateCommandPool(VkDevice device, uint32_t familyIndex) {
     return pool;
 }
 
+//------------------------------------------------------------------------------
+// Resources owned by one frame in flight: the CPU records frame N + 1 while
+// the GPU is still executing frame N, the fence tells when a slot can be
+// recycled
+struct Frame {
+    VkCommandPool commandPool;
+    VkCommandBuffer commandBuffer;
+    VkFence fence;
+    VkSemaphore acquireSemaphore;
+    VkSemaphore releaseSemaphore;
+};
+
+void CreateFrames(vector<Frame>& frames, VkDevice device, uint32_t familyIndex,
+                  uint32_t count) {
+    frames.resize(count);
+    for (Frame& frame : frames) {
+        frame.commandPool = CreateCommandPool(device, familyIndex);
+        VkCommandBufferAllocateInfo allocInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = frame.commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1};
+        frame.commandBuffer = VK_NULL_HANDLE;
+        VK_CHECK(vkAllocateCommandBuffers(device, &allocInfo,
+                                          &frame.commandBuffer));
+        // created signaled so that the first wait on each slot returns
+        frame.fence = CreateFence(device, VK_FENCE_CREATE_SIGNALED_BIT);
+        frame.acquireSemaphore = CreateSemaphore(device);
+        frame.releaseSemaphore = CreateSemaphore(device);
+    }
+}
+
+void DestroyFrames(VkDevice device, vector<Frame>& frames) {
+    for (Frame& frame : frames) {
+        vkDestroySemaphore(device, frame.releaseSemaphore, nullptr);
+        vkDestroySemaphore(device, frame.acquireSemaphore, nullptr);
+        vkDestroyFence(device, frame.fence, nullptr);
+        vkDestroyCommandPool(device, frame.commandPool, nullptr);
+    }
+    frames.clear();
+}
+
 //------------------------------------------------------------------------------
 VkRenderPass CreateRenderPass(VkDevice device) {
     VkRenderPass renderPass = VK_NULL_HANDLE;
@@ -506,6 +573,91 @@ VkPipeline CreateGraphicsPipeline(VkDevice device,
     return pipeline;
 }
 
+//------------------------------------------------------------------------------
+// The cache blob starts with a VkPipelineCacheHeaderVersionOne; data written
+// by a different driver or device is rejected by the driver at best, so check
+// it before handing it over and start from an empty cache on mismatch
+bool ValidPipelineCacheData(VkPhysicalDevice physicalDevice,
+                            const vector<char>& data) {
+    VkPipelineCacheHeaderVersionOne header;
+    if (data.size() < sizeof(header)) return false;
+    memcpy(&header, data.data(), sizeof(header));
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physicalDevice, &props);
+    return header.headerSize >= sizeof(header) &&
+           header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           header.vendorID == props.vendorID &&
+           header.deviceID == props.deviceID &&
+           memcmp(header.pipelineCacheUUID, props.pipelineCacheUUID,
+                  VK_UUID_SIZE) == 0;
+}
+
+// warm is set when valid data was loaded from path
+VkPipelineCache LoadPipelineCache(VkDevice device,
+                                  VkPhysicalDevice physicalDevice,
+                                  const string& path, bool& warm) {
+    vector<char> data;
+    if (FILE* file = fopen(path.c_str(), "rb")) {
+        fseek(file, 0, SEEK_END);
+        const long length = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (length > 0) {
+            data.resize(size_t(length));
+            if (fread(data.data(), 1, data.size(), file) != data.size()) {
+                data.clear();
+            }
+        }
+        fclose(file);
+    }
+    warm = ValidPipelineCacheData(physicalDevice, data);
+    if (!warm && !data.empty()) {
+        cerr << "Ignoring pipeline cache " << path
+             << ": created by a different device or driver" << endl;
+    }
+    VkPipelineCacheCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = warm ? data.size() : 0,
+        .pInitialData = warm ? data.data() : nullptr};
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    VK_CHECK(vkCreatePipelineCache(device, &info, nullptr, &cache));
+    return cache;
+}
+
+// Writes to a uniquely named temporary file next to path, syncs it and
+// renames it over path, so a crash or a concurrent run never leaves a
+// truncated cache behind
+void SavePipelineCache(VkDevice device, VkPipelineCache cache,
+                       const string& path) {
+    size_t length = 0;
+    VK_CHECK(vkGetPipelineCacheData(device, cache, &length, nullptr));
+    vector<char> data(length);
+    VK_CHECK(vkGetPipelineCacheData(device, cache, &length, data.data()));
+    string tmpPath = path + ".XXXXXX";
+    const int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0) {
+        perror("mkstemp() error");
+        return;
+    }
+    // mkstemp creates the file 0600 and rename keeps the mode
+    const mode_t mask = umask(0);
+    umask(mask);
+    if (fchmod(fd, 0644 & ~mask) != 0) perror("fchmod() error");
+    FILE* file = fdopen(fd, "wb");
+    if (!file) {
+        perror("fdopen() error");
+        close(fd);
+        remove(tmpPath.c_str());
+        return;
+    }
+    const bool written = fwrite(data.data(), 1, length, file) == length &&
+                         fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0 || !written ||
+        rename(tmpPath.c_str(), path.c_str()) != 0) {
+        perror("Cannot write pipeline cache");
+        remove(tmpPath.c_str());
+    }
+}
+
 //------------------------------------------------------------------------------
 struct Swapchain {
     VkSwapchainKHR swapchain;
@@ -564,10 +716,18 @@ void DestroySwapchain(VkDevice device, Swapchain& swapchain) {
     vkDestroySwapchainKHR(device, swapchain.swapchain, nullptr);
 }
 
-void ResizeSwapchain(Swapchain& result, VkPhysicalDevice physicalDevice,
+//------------------------------------------------------------------------------
+// A replaced swapchain can still be referenced by frames in flight: it is
+// destroyed once every frame submitted before the replacement has retired
+struct RetiredSwapchain {
+    Swapchain swapchain;
+    uint64_t retiredAt;  // number of frames submitted when it was replaced
+};
+
+void ResizeSwapchain(Swapchain& result, vector<RetiredSwapchain>& retired,
+                     uint64_t frameNumber, VkPhysicalDevice physicalDevice,
                      VkDevice device, VkSurfaceKHR surface,
-                     uint32_t familyIndex, VkRenderPass renderPass,
-                     VkSwapchainKHR oldSwapchain = 0) {
+                     uint32_t familyIndex, VkRenderPass renderPass) {
     VkSurfaceCapabilitiesKHR caps;
     VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface,
                                                        &caps));
@@ -579,8 +739,20 @@ void ResizeSwapchain(Swapchain& result, VkPhysicalDevice physicalDevice,
     Swapchain old = result;
     CreateSwapchain(result, physicalDevice, device, surface, familyIndex,
                     renderPass, old.swapchain);
-    VK_CHECK(vkDeviceWaitIdle(device));
-    DestroySwapchain(device, old);
+    retired.push_back({old, frameNumber});
+}
+
+// completedFrames: number of frames known to have finished executing
+void CollectRetiredSwapchains(VkDevice device,
+                              vector<RetiredSwapchain>& retired,
+                              uint64_t completedFrames) {
+    auto done = [completedFrames](const RetiredSwapchain& r) {
+        return r.retiredAt <= completedFrames;
+    };
+    for (RetiredSwapchain& r : retired) {
+        if (done(r)) DestroySwapchain(device, r.swapchain);
+    }
+    retired.erase(remove_if(begin(retired), end(retired), done), end(retired));
 }
 
 //==============================================================================
@@ -749,9 +921,29 @@ void DestroyBuffer(Buffer& buffer, VkDevice device) {
     vkDestroyBuffer(device, buffer.buffer, nullptr);
 }
 
+//==============================================================================
+//------------------------------------------------------------------------------
+struct Options {
+    uint32_t framesInFlight = 2;
+};
+
+Options ParseOptions(int argc, char const* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--frames-in-flight" && i + 1 < argc) {
+            options.framesInFlight = uint32_t(max(1, atoi(argv[++i])));
+        } else {
+            cerr << "Unknown option " << arg << endl;
+        }
+    }
+    return options;
+}
+
 //==============================================================================
 //------------------------------------------------------------------------------
 int main(int argc, char const* argv[]) {
+    const Options options = ParseOptions(argc, argv);
     assert(glfwInit());
     assert(glfwVulkanSupported() == GLFW_TRUE);
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
@@ -794,9 +986,6 @@ int main(int argc, char const* argv[]) {
     CreateSwapchain(swapchain, physicalDevice, device, surface,
                     graphicsQueueFamily, renderPass);
 
-    VkSemaphore acquireSemaphore = CreateSemaphore(device);
-    VkSemaphore releaseSemaphore = CreateSemaphore(device);
-
     VkQueue queue = VK_NULL_HANDLE;
     vkGetDeviceQueue(device, graphicsQueueFamily, 0, &queue);
     assert(queue != VK_NULL_HANDLE);
@@ -809,19 +998,18 @@ int main(int argc, char const* argv[]) {
     VkShaderModule triangleFS = LoadShader(device, FSPATH);
 
     VkPipelineLayout layout = CreatePipelineLayout(device);
-    VkPipelineCache cache = VK_NULL_HANDLE;
+    const string cachePath = ExecutableDir() + "mesh1.pipelinecache";
+    bool warmCache = false;
+    VkPipelineCache cache =
+        LoadPipelineCache(device, physicalDevice, cachePath, warmCache);
+    const double pipelineStart = glfwGetTime();
     VkPipeline trianglePipeline = CreateGraphicsPipeline(
         device, cache, renderPass, triangleVS, triangleFS, layout);
+    cout << "Pipeline creation: " << (glfwGetTime() - pipelineStart) * 1000
+         << " ms (" << (warmCache ? "warm" : "cold") << " cache)" << endl;
 
-    VkCommandPool commandPool = CreateCommandPool(device, graphicsQueueFamily);
-
-    VkCommandBufferAllocateInfo allocInfo = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = commandPool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1};
-    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
-    VK_CHECK(vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer));
+    vector<Frame> frames;
+    CreateFrames(frames, device, graphicsQueueFamily, options.framesInFlight);
 
     VkPhysicalDeviceMemoryProperties memProps;
     vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProps);
@@ -841,17 +1029,33 @@ int main(int argc, char const* argv[]) {
     assert(ib.size >= mesh.indices.size() * sizeof(uint32_t));
     memcpy(ib.data, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
 
+    vector<RetiredSwapchain> retiredSwapchains;
+    uint64_t frameNumber = 0;
+    bool firstFrame = true;
     while (!glfwWindowShouldClose(win)) {
         glfwPollEvents();
         glfwGetWindowSize(win, &width, &height);
-        ResizeSwapchain(swapchain, physicalDevice, device, surface,
-                        graphicsQueueFamily, renderPass, swapchain.swapchain);
+        ResizeSwapchain(swapchain, retiredSwapchains, frameNumber,
+                        physicalDevice, device, surface, graphicsQueueFamily,
+                        renderPass);
+
+        Frame& frame = frames[frameNumber % frames.size()];
+        // wait for the GPU to retire the last submission that used this slot;
+        // slots are waited on in order, so every earlier frame is done too
+        VK_CHECK(vkWaitForFences(device, 1, &frame.fence, VK_TRUE,
+                                 ~uint64_t(0)));
+        const uint64_t completedFrames =
+            frameNumber >= frames.size() ? frameNumber - frames.size() + 1 : 0;
+        CollectRetiredSwapchains(device, retiredSwapchains, completedFrames);
+
         uint32_t imageIndex = 0;
         VK_CHECK(vkAcquireNextImageKHR(device, swapchain.swapchain,
-                                       ~uint64_t(0), acquireSemaphore,
+                                       ~uint64_t(0), frame.acquireSemaphore,
                                        VK_NULL_HANDLE, &imageIndex));
 
-        VK_CHECK(vkResetCommandPool(device, commandPool, 0));
+        VK_CHECK(vkResetFences(device, 1, &frame.fence));
+        VK_CHECK(vkResetCommandPool(device, frame.commandPool, 0));
+        VkCommandBuffer commandBuffer = frame.commandBuffer;
 
         VkCommandBufferBeginInfo beginInfo = {
             .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
@@ -930,47 +1134,53 @@ int main(int argc, char const* argv[]) {
         VkPipelineStageFlags submitStageMask =
             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 
-        VkSubmitInfo submitInfo = {.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                                   .waitSemaphoreCount = 1,
-                                   .pWaitSemaphores = &acquireSemaphore,
-                                   .pWaitDstStageMask = &submitStageMask,
-                                   .commandBufferCount = 1,
-                                   .pCommandBuffers = &commandBuffer,
-                                   .signalSemaphoreCount = 1,
-                                   .pSignalSemaphores = &releaseSemaphore};
+        VkSubmitInfo submitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &frame.acquireSemaphore,
+            .pWaitDstStageMask = &submitStageMask,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &commandBuffer,
+            .signalSemaphoreCount = 1,
+            .pSignalSemaphores = &frame.releaseSemaphore};
 
-        VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
+        VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, frame.fence));
 
         VkPresentInfoKHR presentInfo = {
             .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
             .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &releaseSemaphore,
+            .pWaitSemaphores = &frame.releaseSemaphore,
             .swapchainCount = 1,
             .pSwapchains = &swapchain.swapchain,
             .pImageIndices = &imageIndex};
 
         VK_CHECK(vkQueuePresentKHR(queue, &presentInfo));
-
-        VK_CHECK(vkDeviceWaitIdle(device));
-        // VK_CHECK(vkQueueWaitIdle(queue));
+        ++frameNumber;
+        if (firstFrame) {
+            // glfw time starts at glfwInit, right at the start of main
+            cout << "First frame after " << glfwGetTime() * 1000 << " ms ("
+                 << (warmCache ? "warm" : "cold") << " pipeline cache)"
+                 << endl;
+            firstFrame = false;
+        }
 
         // TODO: remove when we switch to desktop compute
         glfwWaitEvents();
     }
 
     VK_CHECK(vkDeviceWaitIdle(device));
+    CollectRetiredSwapchains(device, retiredSwapchains, frameNumber);
     DestroyBuffer(vb, device);
     DestroyBuffer(ib, device);
-    ;
-    vkDestroyCommandPool(device, commandPool, nullptr);
+    DestroyFrames(device, frames);
     DestroySwapchain(device, swapchain);
     vkDestroyPipeline(device, trianglePipeline, nullptr);
+    SavePipelineCache(device, cache, cachePath);
+    vkDestroyPipelineCache(device, cache, nullptr);
     vkDestroyPipelineLayout(device, layout, nullptr);
     vkDestroyShaderModule(device, triangleVS, nullptr);
     vkDestroyShaderModule(device, triangleFS, nullptr);
     vkDestroyRenderPass(device, renderPass, nullptr);
-    vkDestroySemaphore(device, releaseSemaphore, nullptr);
-    vkDestroySemaphore(device, acquireSemaphore, nullptr);
     vkDestroySurfaceKHR(instance, surface, nullptr);
     glfwDestroyWindow(win);
     vkDestroyDevice(device, nullptr);
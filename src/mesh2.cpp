@@ -3,21 +3,68 @@
 //#include <volk.h>
 
 #include <meshoptimizer.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <vulkan/vulkan.h>
 
 #include <algorithm>
+#include <atomic>
 #include <bitset>
 #include <cassert>
+#include <cerrno>
+#include <cfloat>
 #include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <zlib.h>
+
 #include "common.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION  // define this in only *one* .cc
 #include "tiny_obj_loader.h"
 
+#ifdef MESH2_COUNT_ALLOCATIONS
+// Heap allocations so far, reported by the loader benchmark: every operator
+// new and every fast_obj array (re)allocation. Only in the benchmark build,
+// the counting operator new replaces the global one of the whole program.
+std::atomic<size_t> allocationCount{0};
+
+void* operator new(size_t size) {
+    ++allocationCount;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+void* CountedRealloc(void* p, size_t size) {
+    ++allocationCount;
+    return realloc(p, size);
+}
+
+#define FAST_OBJ_REALLOC CountedRealloc
+#endif
+#define FAST_OBJ_IMPLEMENTATION
+#include "fast_obj.h"
+
 using namespace std;
 
 string Cwd() {
@@ -30,6 +77,19 @@ string Cwd() {
     }
 }
 
+// Directory of the running executable, with trailing separator
+string ExecutableDir() {
+    char path[PATH_MAX];
+    const ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length <= 0) {
+        perror("readlink() error");
+        return "";
+    }
+    path[length] = '\0';
+    string dir = path;
+    return dir.substr(0, dir.find_last_of('/') + 1);
+}
+
 template <typename ArrayT>
 constexpr size_t size(const ArrayT& array) {
     return sizeof(array) / sizeof(array[0]);
@@ -85,6 +145,14 @@ VkSemaphore CreateSemaphore(VkDevice device) {
     return semaphore;
 }
 
+VkFence CreateFence(VkDevice device, VkFenceCreateFlags flags = 0) {
+    VkFenceCreateInfo info = {.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+                              .flags = flags};
+    VkFence fence = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateFence(device, &info, nullptr, &fence));
+    return fence;
+}
+
 VkBool32 DebugReportCallback(VkDebugReportFlagsEXT flags,
                              VkDebugReportObjectTypeEXT objectType,
                              uint64_t object, size_t location,
@@ -117,7 +185,9 @@ VkDebugReportCallbackEXT RegisterDebugCallback(VkInstance instance) {
 VkImageMemoryBarrier ImageBarrier(VkImage image, VkAccessFlags srcAccessMask,
                                   VkImageLayout oldLaout,
                                   VkAccessFlags dstAccessMask,
-                                  VkImageLayout newLayout) {
+                                  VkImageLayout newLayout,
+                                  VkImageAspectFlags aspectMask =
+                                      VK_IMAGE_ASPECT_COLOR_BIT) {
     VkImageMemoryBarrier result = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
         .srcAccessMask = srcAccessMask,
@@ -128,13 +198,28 @@ VkImageMemoryBarrier ImageBarrier(VkImage image, VkAccessFlags srcAccessMask,
         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
         .image = image};
 
-    result.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    result.subresourceRange.aspectMask = aspectMask;
     result.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
     result.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
 
     return result;
 }
 
+VkBufferMemoryBarrier BufferBarrier(VkBuffer buffer,
+                                    VkAccessFlags srcAccessMask,
+                                    VkAccessFlags dstAccessMask) {
+    VkBufferMemoryBarrier result = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = srcAccessMask,
+        .dstAccessMask = dstAccessMask,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = buffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE};
+    return result;
+}
+
 bool SupportPresentation(VkInstance instance, VkPhysicalDevice physicalDevice,
                          uint32_t familyIndex) {
     return glfwGetPhysicalDevicePresentationSupport(instance, physicalDevice,
@@ -206,7 +291,53 @@ VkPhysicalDevice CreatePhysicalDevice(
 }
 
 //------------------------------------------------------------------------------
-VkDevice CreateDevice(VkPhysicalDevice physicalDevice, uint32_t queueFamily) {
+// Optional device features, enabled only when supported and needed
+struct DeviceFeatures {
+    // 16 bit types in storage buffers, used by the quantized vertex format
+    bool storage16 = false;
+    // VK_KHR_draw_indirect_count, used by GPU culling
+    bool drawIndirectCount = false;
+    bool multiDrawIndirect = false;
+    // gl_DrawIDARB, which every vertex shader reads
+    bool shaderDrawParameters = false;
+};
+
+bool HasDeviceExtension(VkPhysicalDevice physicalDevice, const char* name) {
+    uint32_t count = 0;
+    VK_CHECK(vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+                                                  &count, nullptr));
+    vector<VkExtensionProperties> extensions(count);
+    VK_CHECK(vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+                                                  &count, extensions.data()));
+    for (const VkExtensionProperties& e : extensions) {
+        if (strcmp(e.extensionName, name) == 0) return true;
+    }
+    return false;
+}
+
+DeviceFeatures QueryDeviceFeatures(VkPhysicalDevice physicalDevice) {
+    VkPhysicalDeviceShaderDrawParametersFeatures drawParameters = {
+        .sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_DRAW_PARAMETERS_FEATURES};
+    VkPhysicalDevice16BitStorageFeatures storage16 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES,
+        .pNext = &drawParameters};
+    VkPhysicalDeviceFeatures2 features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &storage16};
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+    DeviceFeatures result;
+    result.storage16 = storage16.storageBuffer16BitAccess == VK_TRUE;
+    result.drawIndirectCount = HasDeviceExtension(
+        physicalDevice, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+    result.multiDrawIndirect = features.features.multiDrawIndirect == VK_TRUE;
+    result.shaderDrawParameters =
+        drawParameters.shaderDrawParameters == VK_TRUE;
+    return result;
+}
+
+VkDevice CreateDevice(VkPhysicalDevice physicalDevice, uint32_t queueFamily,
+                      const DeviceFeatures& enabled = DeviceFeatures()) {
     const float priorities[] = {1.0f};
     VkDeviceQueueCreateInfo queueCreateInfo = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
@@ -214,19 +345,32 @@ VkDevice CreateDevice(VkPhysicalDevice physicalDevice, uint32_t queueFamily) {
         .queueCount = 1,
         .pQueuePriorities = priorities};
 
-    const char* extensions[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-                                VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME};
+    vector<const char*> extensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+                                      VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME};
+    if (enabled.drawIndirectCount) {
+        extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+    }
     // TODO
     VkPhysicalDeviceFeatures features = {.vertexPipelineStoresAndAtomics =
                                              true};
     features.vertexPipelineStoresAndAtomics = true;
+    features.multiDrawIndirect = enabled.multiDrawIndirect;
+    VkPhysicalDeviceShaderDrawParametersFeatures drawParametersFeatures = {
+        .sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_DRAW_PARAMETERS_FEATURES,
+        .shaderDrawParameters = enabled.shaderDrawParameters};
+    VkPhysicalDevice16BitStorageFeatures storage16Features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES,
+        .pNext = &drawParametersFeatures,
+        .storageBuffer16BitAccess = enabled.storage16};
 
     VkDeviceCreateInfo deviceInfo = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .pNext = &storage16Features,
         .queueCreateInfoCount = 1,
         .pQueueCreateInfos = &queueCreateInfo,
-        .enabledExtensionCount = sizeof(extensions) / sizeof(extensions[0]),
-        .ppEnabledExtensionNames = extensions,
+        .enabledExtensionCount = uint32_t(extensions.size()),
+        .ppEnabledExtensionNames = extensions.data(),
         .pEnabledFeatures = &features};
 
     VkDevice device = VK_NULL_HANDLE;
@@ -236,18 +380,49 @@ VkDevice CreateDevice(VkPhysicalDevice physicalDevice, uint32_t queueFamily) {
 }
 
 //------------------------------------------------------------------------------
-VkSwapchainKHR CreateSwapChain(VkPhysicalDevice physicalDevice, VkDevice device,
-                               VkSurfaceKHR surface, uint32_t familyIndex, /*
-                                uint32_t width, uint32_t height,*/
-                               VkSwapchainKHR oldSwapchain = 0) {
-    VkSurfaceCapabilitiesKHR surfaceCapabilities;
-    VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface,
-                                                       &surfaceCapabilities));
-    VkSurfaceCapabilitiesKHR caps;
-    VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface,
-                                                       &caps));
-    const uint32_t width = caps.currentExtent.width;
-    const uint32_t height = caps.currentExtent.height;
+const char* PresentModeString(VkPresentModeKHR mode) {
+    switch (mode) {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR:
+            return "immediate";
+        case VK_PRESENT_MODE_MAILBOX_KHR:
+            return "mailbox";
+        case VK_PRESENT_MODE_FIFO_KHR:
+            return "fifo";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+            return "fifo_relaxed";
+        default:
+            return "unknown";
+    }
+}
+
+// Returns the requested mode if the surface supports it, FIFO otherwise:
+// FIFO is the only mode the spec requires to be available
+VkPresentModeKHR SelectPresentMode(VkPhysicalDevice physicalDevice,
+                                   VkSurfaceKHR surface,
+                                   VkPresentModeKHR requested) {
+    uint32_t count = 0;
+    VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface,
+                                                       &count, nullptr));
+    vector<VkPresentModeKHR> presentModes(count);
+    VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(
+        physicalDevice, surface, &count, presentModes.data()));
+    for (uint32_t i = 0; i != count; ++i) {
+        if (presentModes[i] == requested) return requested;
+    }
+    cerr << "Present mode " << PresentModeString(requested)
+         << " not supported, falling back to "
+         << PresentModeString(VK_PRESENT_MODE_FIFO_KHR) << endl;
+    return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+//------------------------------------------------------------------------------
+VkSwapchainKHR CreateSwapChain(
+    VkPhysicalDevice physicalDevice, VkDevice device, VkSurfaceKHR surface,
+    const VkSurfaceCapabilitiesKHR& surfaceCapabilities, uint32_t familyIndex,
+    VkPresentModeKHR presentMode, uint32_t imageCount,
+    VkSwapchainKHR oldSwapchain = 0) {
+    const uint32_t width = surfaceCapabilities.currentExtent.width;
+    const uint32_t height = surfaceCapabilities.currentExtent.height;
 
     VkCompositeAlphaFlagBitsKHR surfaceComposite =
         (surfaceCapabilities.supportedCompositeAlpha &
@@ -261,6 +436,12 @@ VkSwapchainKHR CreateSwapChain(VkPhysicalDevice physicalDevice, VkDevice device,
                         ? VK_COMPOSITE_ALPHA_POST_MULTIPLIED_BIT_KHR
                         : VK_COMPOSITE_ALPHA_INHERIT_BIT_KHR;
 
+    // maxImageCount == 0 means no upper limit
+    imageCount = max(imageCount, surfaceCapabilities.minImageCount);
+    if (surfaceCapabilities.maxImageCount > 0) {
+        imageCount = min(imageCount, surfaceCapabilities.maxImageCount);
+    }
+
 #ifdef PRINT_SURFACE_CAPABILITIES
     cout << "currentExtent: "
          << "width: " << surfaceCapabilities.currentExtent.width
@@ -286,7 +467,7 @@ VkSwapchainKHR CreateSwapChain(VkPhysicalDevice physicalDevice, VkDevice device,
     VkSwapchainCreateInfoKHR info = {
         .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
         .surface = surface,
-        .minImageCount = 2,
+        .minImageCount = imageCount,
         .imageFormat = VK_FORMAT_B8G8R8A8_UNORM,
         .imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR,
         .imageExtent = {.width = width, .height = height},
@@ -297,7 +478,7 @@ VkSwapchainKHR CreateSwapChain(VkPhysicalDevice physicalDevice, VkDevice device,
         // VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,  //
         // surfaceCapabilities.currentTransform,
         .compositeAlpha = surfaceComposite,
-        .presentMode = VK_PRESENT_MODE_FIFO_KHR,
+        .presentMode = presentMode,
         .oldSwapchain = oldSwapchain};
     VkSwapchainKHR swapchain = VK_NULL_HANDLE;
     VK_CHECK(vkCreateSwapchainKHR(device, &info, nullptr, &swapchain));
@@ -320,13 +501,65 @@ VkCommandPool CreateCommandPool(VkDevice device, uint32_t familyIndex) {
 }
 
 //------------------------------------------------------------------------------
-VkRenderPass CreateRenderPass(VkDevice device) {
+// Resources owned by one frame in flight: the CPU records frame N + 1 while
+// the GPU is still executing frame N, the fence tells when a slot can be
+// recycled
+struct Frame {
+    VkCommandPool commandPool;
+    VkCommandBuffer commandBuffer;
+    VkFence fence;
+    VkSemaphore acquireSemaphore;
+    VkSemaphore releaseSemaphore;
+};
+
+void CreateFrames(vector<Frame>& frames, VkDevice device, uint32_t familyIndex,
+                  uint32_t count) {
+    frames.resize(count);
+    for (Frame& frame : frames) {
+        frame.commandPool = CreateCommandPool(device, familyIndex);
+        VkCommandBufferAllocateInfo allocInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = frame.commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1};
+        frame.commandBuffer = VK_NULL_HANDLE;
+        VK_CHECK(vkAllocateCommandBuffers(device, &allocInfo,
+                                          &frame.commandBuffer));
+        // created signaled so that the first wait on each slot returns
+        frame.fence = CreateFence(device, VK_FENCE_CREATE_SIGNALED_BIT);
+        frame.acquireSemaphore = CreateSemaphore(device);
+        frame.releaseSemaphore = CreateSemaphore(device);
+    }
+}
+
+void DestroyFrames(VkDevice device, vector<Frame>& frames) {
+    for (Frame& frame : frames) {
+        vkDestroySemaphore(device, frame.releaseSemaphore, nullptr);
+        vkDestroySemaphore(device, frame.acquireSemaphore, nullptr);
+        vkDestroyFence(device, frame.fence, nullptr);
+        vkDestroyCommandPool(device, frame.commandPool, nullptr);
+    }
+    frames.clear();
+}
+
+//------------------------------------------------------------------------------
+const VkFormat DEPTH_FORMAT = VK_FORMAT_D32_SFLOAT;
+
+// Color and depth attachment, both kept in attachment layout and stored for
+// the next pass. load continues the contents of an earlier pass in the same
+// frame instead of clearing them; both variants are compatible and share the
+// framebuffers and pipelines.
+VkRenderPass CreateRenderPass(VkDevice device, bool load = false) {
     VkRenderPass renderPass = VK_NULL_HANDLE;
     VkAttachmentReference colorAttachments = {
         0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference depthAttachment = {
+        1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
 
-    VkAttachmentDescription attachments[1] = {};
-    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    const VkAttachmentLoadOp loadOp =
+        load ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    VkAttachmentDescription attachments[2] = {};
+    attachments[0].loadOp = loadOp;
     attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     attachments[0].format = VK_FORMAT_B8G8R8A8_UNORM;
     attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
@@ -334,11 +567,23 @@ VkRenderPass CreateRenderPass(VkDevice device) {
     attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     attachments[0].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
     attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    // stored for the depth pyramid
+    attachments[1].loadOp = loadOp;
+    attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[1].format = DEPTH_FORMAT;
+    attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[1].initialLayout =
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[1].finalLayout =
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
     VkSubpassDescription subpass = {
         .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
         .colorAttachmentCount = 1,
-        .pColorAttachments = &colorAttachments};
+        .pColorAttachments = &colorAttachments,
+        .pDepthStencilAttachment = &depthAttachment};
 
     VkRenderPassCreateInfo renderPassCreateInfo = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
@@ -354,13 +599,14 @@ VkRenderPass CreateRenderPass(VkDevice device) {
 
 //------------------------------------------------------------------------------
 VkFramebuffer CreateFramebuffer(VkDevice device, VkRenderPass renderPass,
-                                VkImageView imageView, uint32_t width,
-                                uint32_t height) {
+                                VkImageView imageView, VkImageView depthView,
+                                uint32_t width, uint32_t height) {
+    const VkImageView attachments[] = {imageView, depthView};
     VkFramebufferCreateInfo info = {
         .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
         .renderPass = renderPass,
-        .attachmentCount = 1,
-        .pAttachments = &imageView,
+        .attachmentCount = size(attachments),
+        .pAttachments = attachments,
         .width = width,
         .height = height,
         .layers = 1};
@@ -369,14 +615,19 @@ VkFramebuffer CreateFramebuffer(VkDevice device, VkRenderPass renderPass,
     return framebuffer;
 }
 
-VkImageView CreateImageView(VkDevice device, VkImage image) {
+VkImageView CreateImageView(
+    VkDevice device, VkImage image,
+    VkFormat format = VK_FORMAT_B8G8R8A8_UNORM,
+    VkImageAspectFlags aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+    uint32_t baseLevel = 0, uint32_t levelCount = 1) {
     VkImageViewCreateInfo info = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
         .image = image,
         .viewType = VK_IMAGE_VIEW_TYPE_2D,
-        .format = VK_FORMAT_B8G8R8A8_UNORM,
-        .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                             .levelCount = 1,
+        .format = format,
+        .subresourceRange = {.aspectMask = aspectMask,
+                             .baseMipLevel = baseLevel,
+                             .levelCount = levelCount,
                              .layerCount = 1}};
 
     VkImageView view = VK_NULL_HANDLE;
@@ -405,27 +656,41 @@ VkShaderModule LoadShader(VkDevice device, const char* path) {
     return shaderModule;
 }
 
-VkPipelineLayout CreatePipelineLayout(VkDevice device,
-                                      VkDescriptorSetLayout& setLayout) {
-    VkDescriptorSetLayoutBinding setBindings[1] = {};
-    setBindings[0].binding = 0;
-    setBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    setBindings[0].descriptorCount = 1;
-    setBindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+// Push descriptor set with one descriptor of bindings[i] at binding i, plus
+// pushConstantSize bytes of push constants, all visible to stages
+VkPipelineLayout CreatePipelineLayout(
+    VkDevice device, VkDescriptorSetLayout& setLayout,
+    uint32_t pushConstantSize = 0,
+    const vector<VkDescriptorType>& bindings = {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER},
+    VkShaderStageFlags stages = VK_SHADER_STAGE_VERTEX_BIT) {
+    vector<VkDescriptorSetLayoutBinding> setBindings(bindings.size());
+    for (uint32_t i = 0; i != bindings.size(); ++i) {
+        setBindings[i].binding = i;
+        setBindings[i].descriptorType = bindings[i];
+        setBindings[i].descriptorCount = 1;
+        setBindings[i].stageFlags = stages;
+    }
     VkDescriptorSetLayoutCreateInfo setCreateInfo = {
         VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO};
     setCreateInfo.flags =
         VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
-    setCreateInfo.bindingCount = size(setBindings);
-    setCreateInfo.pBindings = setBindings;
+    setCreateInfo.bindingCount = uint32_t(setBindings.size());
+    setCreateInfo.pBindings = setBindings.data();
     setLayout = VK_NULL_HANDLE;
     VK_CHECK(vkCreateDescriptorSetLayout(device, &setCreateInfo, nullptr,
                                          &setLayout));
 
+    VkPushConstantRange pushConstants = {
+        .stageFlags = stages,
+        .offset = 0,
+        .size = pushConstantSize};
     VkPipelineLayoutCreateInfo info = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
         .setLayoutCount = 1,
-        .pSetLayouts = &setLayout};
+        .pSetLayouts = &setLayout,
+        .pushConstantRangeCount = pushConstantSize > 0 ? 1u : 0u,
+        .pPushConstantRanges = &pushConstants};
 
     VkPipelineLayout layout = VK_NULL_HANDLE;
     VK_CHECK(vkCreatePipelineLayout(device, &info, nullptr, &layout));
@@ -433,10 +698,14 @@ VkPipelineLayout CreatePipelineLayout(VkDevice device,
     return layout;
 }
 
+// Reverse-Z depth testing. Without a fragment shader the pipeline writes depth
+// only, for a prepass; the color pass after it leaves depth untouched and
+// only shades fragments matching the prepass depth.
 VkPipeline CreateGraphicsPipeline(VkDevice device,
                                   VkPipelineCache pipelineCache,
                                   VkRenderPass renderPass, VkShaderModule vs,
-                                  VkShaderModule fs, VkPipelineLayout layout) {
+                                  VkShaderModule fs, VkPipelineLayout layout,
+                                  bool afterPrepass = false) {
     VkPipelineShaderStageCreateInfo stages[2] = {};
     stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
@@ -449,7 +718,7 @@ VkPipeline CreateGraphicsPipeline(VkDevice device,
 
     VkGraphicsPipelineCreateInfo info = {
         .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-        .stageCount = sizeof(stages) / sizeof(stages[0]),
+        .stageCount = fs ? 2u : 1u,
         .pStages = stages};
 
     VkPipelineVertexInputStateCreateInfo vertexInput = {
@@ -473,7 +742,11 @@ VkPipeline CreateGraphicsPipeline(VkDevice device,
     info.pRasterizationState = &rasterizationState;
 
     VkPipelineDepthStencilStateCreateInfo depthStencilState = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO};
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+        .depthTestEnable = VK_TRUE,
+        .depthWriteEnable = !afterPrepass,
+        .depthCompareOp = afterPrepass ? VK_COMPARE_OP_EQUAL
+                                       : VK_COMPARE_OP_GREATER};
 
     info.pDepthStencilState = &depthStencilState;
 
@@ -483,8 +756,10 @@ VkPipeline CreateGraphicsPipeline(VkDevice device,
     info.pMultisampleState = &multisampleState;
 
     VkPipelineColorBlendAttachmentState colorAttachmentState = {
-        .colorWriteMask = VK_COLOR_COMPONENT_A_BIT | VK_COLOR_COMPONENT_B_BIT |
-                          VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_R_BIT};
+        .colorWriteMask =
+            fs ? VK_COLOR_COMPONENT_A_BIT | VK_COLOR_COMPONENT_B_BIT |
+                     VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_R_BIT
+               : 0u};
 
     VkPipelineColorBlendStateCreateInfo colorBlendState = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
@@ -510,28 +785,251 @@ VkPipeline CreateGraphicsPipeline(VkDevice device,
     return pipeline;
 }
 
+VkPipeline CreateComputePipeline(VkDevice device,
+                                 VkPipelineCache pipelineCache,
+                                 VkShaderModule cs, VkPipelineLayout layout) {
+    VkComputePipelineCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage = {.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                  .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                  .module = cs,
+                  .pName = "main"},
+        .layout = layout};
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateComputePipelines(device, pipelineCache, 1, &info,
+                                      nullptr, &pipeline));
+    return pipeline;
+}
+
+//------------------------------------------------------------------------------
+// The cache blob starts with a VkPipelineCacheHeaderVersionOne; data written
+// by a different driver or device is rejected by the driver at best, so check
+// it before handing it over and start from an empty cache on mismatch
+bool ValidPipelineCacheData(VkPhysicalDevice physicalDevice,
+                            const vector<char>& data) {
+    VkPipelineCacheHeaderVersionOne header;
+    if (data.size() < sizeof(header)) return false;
+    memcpy(&header, data.data(), sizeof(header));
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physicalDevice, &props);
+    return header.headerSize >= sizeof(header) &&
+           header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           header.vendorID == props.vendorID &&
+           header.deviceID == props.deviceID &&
+           memcmp(header.pipelineCacheUUID, props.pipelineCacheUUID,
+                  VK_UUID_SIZE) == 0;
+}
+
+// warm is set when valid data was loaded from path
+VkPipelineCache LoadPipelineCache(VkDevice device,
+                                  VkPhysicalDevice physicalDevice,
+                                  const string& path, bool& warm) {
+    vector<char> data;
+    if (FILE* file = fopen(path.c_str(), "rb")) {
+        fseek(file, 0, SEEK_END);
+        const long length = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (length > 0) {
+            data.resize(size_t(length));
+            if (fread(data.data(), 1, data.size(), file) != data.size()) {
+                data.clear();
+            }
+        }
+        fclose(file);
+    }
+    warm = ValidPipelineCacheData(physicalDevice, data);
+    if (!warm && !data.empty()) {
+        cerr << "Ignoring pipeline cache " << path
+             << ": created by a different device or driver" << endl;
+    }
+    VkPipelineCacheCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = warm ? data.size() : 0,
+        .pInitialData = warm ? data.data() : nullptr};
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    VK_CHECK(vkCreatePipelineCache(device, &info, nullptr, &cache));
+    return cache;
+}
+
+// Writes to a uniquely named temporary file next to path, syncs it and
+// renames it over path, so a crash or a concurrent run never leaves a
+// truncated cache behind
+void SavePipelineCache(VkDevice device, VkPipelineCache cache,
+                       const string& path) {
+    size_t length = 0;
+    VK_CHECK(vkGetPipelineCacheData(device, cache, &length, nullptr));
+    vector<char> data(length);
+    VK_CHECK(vkGetPipelineCacheData(device, cache, &length, data.data()));
+    string tmpPath = path + ".XXXXXX";
+    const int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0) {
+        perror("mkstemp() error");
+        return;
+    }
+    // mkstemp creates the file 0600 and rename keeps the mode
+    const mode_t mask = umask(0);
+    umask(mask);
+    if (fchmod(fd, 0644 & ~mask) != 0) perror("fchmod() error");
+    FILE* file = fdopen(fd, "wb");
+    if (!file) {
+        perror("fdopen() error");
+        close(fd);
+        remove(tmpPath.c_str());
+        return;
+    }
+    const bool written = fwrite(data.data(), 1, length, file) == length &&
+                         fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0 || !written ||
+        rename(tmpPath.c_str(), path.c_str()) != 0) {
+        perror("Cannot write pipeline cache");
+        remove(tmpPath.c_str());
+    }
+}
+
+//------------------------------------------------------------------------------
+uint32_t SelectMemoryType(const VkPhysicalDeviceMemoryProperties& memProps,
+                          uint32_t memTypeBits, VkMemoryPropertyFlags flags) {
+    for (uint32_t i = 0; i != memProps.memoryTypeCount; ++i) {
+        if ((memTypeBits & (1 << i)) != 0 &&
+            (memProps.memoryTypes[i].propertyFlags & flags) == flags) {
+            return i;
+        }
+    }
+    assert(!"No compatible memory type found");
+    return ~0u;
+}
+
+// Device local image with its own memory and a view of every level; images
+// are few and sized by the swapchain, so they bypass the buffer allocator
+struct Image {
+    VkImage image;
+    VkDeviceMemory memory;
+    VkImageView view;
+    uint32_t width;
+    uint32_t height;
+    uint32_t levels;
+};
+
+void CreateImage(Image& result, VkDevice device,
+                 const VkPhysicalDeviceMemoryProperties& memProps,
+                 uint32_t width, uint32_t height, uint32_t levels,
+                 VkFormat format, VkImageUsageFlags usage,
+                 VkImageAspectFlags aspectMask) {
+    VkImageCreateInfo createInfo = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = format,
+        .extent = {width, height, 1},
+        .mipLevels = levels,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        .usage = usage,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED};
+    VK_CHECK(vkCreateImage(device, &createInfo, nullptr, &result.image));
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, result.image, &requirements);
+    VkMemoryAllocateInfo allocateInfo = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+        .memoryTypeIndex =
+            SelectMemoryType(memProps, requirements.memoryTypeBits,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)};
+    VK_CHECK(vkAllocateMemory(device, &allocateInfo, nullptr, &result.memory));
+    VK_CHECK(vkBindImageMemory(device, result.image, result.memory, 0));
+
+    result.view =
+        CreateImageView(device, result.image, format, aspectMask, 0, levels);
+    result.width = width;
+    result.height = height;
+    result.levels = levels;
+}
+
+void DestroyImage(VkDevice device, Image& image) {
+    vkDestroyImageView(device, image.view, nullptr);
+    vkDestroyImage(device, image.image, nullptr);
+    vkFreeMemory(device, image.memory, nullptr);
+}
+
+// Nearest, clamped: the depth pyramid is only read with texelFetch
+VkSampler CreateSampler(VkDevice device) {
+    VkSamplerCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_NEAREST,
+        .minFilter = VK_FILTER_NEAREST,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .maxLod = VK_LOD_CLAMP_NONE};
+    VkSampler sampler = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateSampler(device, &info, nullptr, &sampler));
+    return sampler;
+}
+
+uint32_t PreviousPow2(uint32_t v) {
+    uint32_t result = 1;
+    while (result * 2 <= v) result *= 2;
+    return result;
+}
+
+// Hierarchical depth: level 0 is the depth buffer rounded down to a power of
+// two, every texel of every level holds the farthest depth it covers
+void CreateDepthPyramid(Image& result, vector<VkImageView>& levelViews,
+                        VkDevice device,
+                        const VkPhysicalDeviceMemoryProperties& memProps,
+                        uint32_t width, uint32_t height) {
+    const uint32_t w = PreviousPow2(width);
+    const uint32_t h = PreviousPow2(height);
+    uint32_t levels = 1;
+    while ((max(w, h) >> levels) != 0) ++levels;
+    CreateImage(result, device, memProps, w, h, levels, VK_FORMAT_R32_SFLOAT,
+                VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_IMAGE_ASPECT_COLOR_BIT);
+    levelViews.resize(levels);
+    for (uint32_t i = 0; i != levels; ++i) {
+        levelViews[i] =
+            CreateImageView(device, result.image, VK_FORMAT_R32_SFLOAT,
+                            VK_IMAGE_ASPECT_COLOR_BIT, i, 1);
+    }
+}
+
 //------------------------------------------------------------------------------
 struct Swapchain {
     VkSwapchainKHR swapchain;
     vector<VkImage> images;
     vector<VkImageView> imageViews;
     vector<VkFramebuffer> framebuffers;
+    // shared by all images: frames in flight execute in submission order
+    Image depth;
+    Image depthPyramid;
+    vector<VkImageView> depthPyramidLevels;
     uint32_t width;
     uint32_t height;
     uint32_t imageCount;
+    // requested configuration, reused when the swapchain is recreated
+    VkPresentModeKHR presentMode;
+    uint32_t minImageCount;
 };
 
-void CreateSwapchain(Swapchain& result, VkPhysicalDevice physicalDevice,
+// Returns false and leaves result untouched when the surface has a zero
+// extent, e.g. while the window is minimized
+bool CreateSwapchain(Swapchain& result, VkPhysicalDevice physicalDevice,
                      VkDevice device, VkSurfaceKHR surface,
                      uint32_t familyIndex, VkRenderPass renderPass,
+                     VkPresentModeKHR presentMode, uint32_t minImageCount,
                      VkSwapchainKHR oldSwapchain = 0) {
     VkSurfaceCapabilitiesKHR caps;
     VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface,
                                                        &caps));
     const uint32_t width = caps.currentExtent.width;
     const uint32_t height = caps.currentExtent.height;
-    VkSwapchainKHR swapchain = CreateSwapChain(physicalDevice, device, surface,
-                                               familyIndex, oldSwapchain);
+    if (width == 0 || height == 0) return false;
+    VkSwapchainKHR swapchain =
+        CreateSwapChain(physicalDevice, device, surface, caps, familyIndex,
+                        presentMode, minImageCount, oldSwapchain);
     uint32_t imageCount = 0;
     VK_CHECK(vkGetSwapchainImagesKHR(device, swapchain, &imageCount, nullptr));
     vector<VkImage> images(imageCount);
@@ -543,19 +1041,37 @@ void CreateSwapchain(Swapchain& result, VkPhysicalDevice physicalDevice,
         imageViews[i] = CreateImageView(device, images[i]);
     }
 
+    VkPhysicalDeviceMemoryProperties memProps;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProps);
+    Image depth;
+    CreateImage(depth, device, memProps, width, height, 1, DEPTH_FORMAT,
+                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                    VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_IMAGE_ASPECT_DEPTH_BIT);
+    Image depthPyramid;
+    vector<VkImageView> depthPyramidLevels;
+    CreateDepthPyramid(depthPyramid, depthPyramidLevels, device, memProps,
+                       width, height);
+
     vector<VkFramebuffer> framebuffers(imageCount);
     for (uint32_t i = 0; i != imageCount; ++i) {
-        framebuffers[i] =
-            CreateFramebuffer(device, renderPass, imageViews[i], width, height);
+        framebuffers[i] = CreateFramebuffer(device, renderPass, imageViews[i],
+                                            depth.view, width, height);
     }
 
     result.swapchain = swapchain;
     result.images = images;
     result.imageViews = imageViews;
     result.framebuffers = framebuffers;
+    result.depth = depth;
+    result.depthPyramid = depthPyramid;
+    result.depthPyramidLevels = depthPyramidLevels;
     result.width = width;
     result.height = height;
     result.imageCount = imageCount;
+    result.presentMode = presentMode;
+    result.minImageCount = minImageCount;
+    return true;
 }
 
 void DestroySwapchain(VkDevice device, Swapchain& swapchain) {
@@ -565,28 +1081,208 @@ void DestroySwapchain(VkDevice device, Swapchain& swapchain) {
     for (uint32_t i = 0; i != swapchain.imageCount; ++i) {
         vkDestroyImageView(device, swapchain.imageViews[i], nullptr);
     }
+    for (VkImageView view : swapchain.depthPyramidLevels) {
+        vkDestroyImageView(device, view, nullptr);
+    }
+    DestroyImage(device, swapchain.depthPyramid);
+    DestroyImage(device, swapchain.depth);
     vkDestroySwapchainKHR(device, swapchain.swapchain, nullptr);
 }
 
-void ResizeSwapchain(Swapchain& result, VkPhysicalDevice physicalDevice,
-                     VkDevice device, VkSurfaceKHR surface,
-                     uint32_t familyIndex, VkRenderPass renderPass,
-                     VkSwapchainKHR oldSwapchain = 0) {
-    VkSurfaceCapabilitiesKHR caps;
-    VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface,
-                                                       &caps));
-    const uint32_t newWidth = caps.currentExtent.width;
-    const uint32_t newHeight = caps.currentExtent.height;
-
-    if (result.width == newWidth && result.height == newHeight) return;
+//------------------------------------------------------------------------------
+// A replaced swapchain can still be referenced by frames in flight: it is
+// destroyed once every frame submitted before the replacement has retired
+struct RetiredSwapchain {
+    Swapchain swapchain;
+    uint64_t retiredAt;  // number of frames submitted when it was replaced
+};
 
+bool RecreateSwapchain(Swapchain& result, vector<RetiredSwapchain>& retired,
+                       uint64_t frameNumber, VkPhysicalDevice physicalDevice,
+                       VkDevice device, VkSurfaceKHR surface,
+                       uint32_t familyIndex, VkRenderPass renderPass) {
     Swapchain old = result;
-    CreateSwapchain(result, physicalDevice, device, surface, familyIndex,
-                    renderPass, old.swapchain);
-    VK_CHECK(vkDeviceWaitIdle(device));
-    DestroySwapchain(device, old);
+    if (!CreateSwapchain(result, physicalDevice, device, surface, familyIndex,
+                         renderPass, old.presentMode, old.minImageCount,
+                         old.swapchain)) {
+        return false;
+    }
+    retired.push_back({old, frameNumber});
+    return true;
+}
+
+// completedFrames: number of frames known to have finished executing
+void CollectRetiredSwapchains(VkDevice device,
+                              vector<RetiredSwapchain>& retired,
+                              uint64_t completedFrames) {
+    auto done = [completedFrames](const RetiredSwapchain& r) {
+        return r.retiredAt <= completedFrames;
+    };
+    for (RetiredSwapchain& r : retired) {
+        if (done(r)) DestroySwapchain(device, r.swapchain);
+    }
+    retired.erase(remove_if(begin(retired), end(retired), done), end(retired));
+}
+
+void FramebufferSizeCallback(GLFWwindow* window, int width, int height) {
+    bool* resized = static_cast<bool*>(glfwGetWindowUserPointer(window));
+    *resized = true;
+}
+
+//==============================================================================
+//------------------------------------------------------------------------------
+bool EndsWith(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() &&
+           s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
 }
 
+// Stream buffer over a gzip file: a worker thread inflates fixed size chunks
+// into a bounded queue while the reader consumes the previous ones, so
+// decompression overlaps parsing and memory stays at chunkCount * chunkSize.
+// Tar archives (the shipped assets are .tar.gz named .obj.gz) are unwrapped
+// to the first .obj member.
+class GzStreamBuf : public std::streambuf {
+  public:
+    GzStreamBuf(const char* path, size_t chunkSize = 1 << 20,
+                size_t chunkCount = 4)
+        : chunks_(chunkCount, vector<char>(chunkSize)) {
+        for (size_t i = 0; i != chunks_.size(); ++i) free_.push_back(i);
+        file_ = gzopen(path, "rb");
+        if (!file_) {
+            cerr << "Cannot open " << path << endl;
+            done_ = true;
+            error_ = true;
+            return;
+        }
+        gzbuffer(file_, 256 * 1024);
+        worker_ = thread(&GzStreamBuf::Inflate, this);
+    }
+    ~GzStreamBuf() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            cancel_ = true;
+        }
+        cv_.notify_all();
+        if (worker_.joinable()) worker_.join();
+        if (file_) gzclose(file_);
+    }
+    bool Error() const { return error_; }
+    size_t BytesInflated() const { return inflated_; }
+
+  protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        unique_lock<mutex> lock(mutex_);
+        if (current_ != NONE) {
+            free_.push_back(current_);
+            current_ = NONE;
+            cv_.notify_all();
+        }
+        cv_.wait(lock, [this] { return !full_.empty() || done_; });
+        if (full_.empty()) return traits_type::eof();
+        current_ = full_.front().first;
+        char* begin = chunks_[current_].data();
+        setg(begin, begin, begin + full_.front().second);
+        full_.pop_front();
+        return traits_type::to_int_type(*gptr());
+    }
+
+  private:
+    static constexpr size_t NONE = ~size_t(0);
+    static constexpr size_t TAR_BLOCK = 512;
+
+    // Reads exactly size bytes, false on a short read.
+    bool Read(char* data, size_t size) {
+        return gzread(file_, data, unsigned(size)) == int(size);
+    }
+
+    // Positions the stream at the data of the first .obj member of a tar
+    // archive and stores its size in remaining. For plain gzip files the
+    // bytes already read are left in header for the first chunk.
+    bool SkipTarHeaders(char* header, size_t& headerBytes,
+                        uint64_t& remaining) {
+        const int n = gzread(file_, header, TAR_BLOCK);
+        if (n < 0) return false;
+        headerBytes = size_t(n);
+        if (headerBytes < TAR_BLOCK || memcmp(header + 257, "ustar", 5) != 0)
+            return true;
+        while (true) {
+            const string name(header, strnlen(header, 100));
+            const uint64_t size = strtoull(string(header + 124, 12).c_str(),
+                                           nullptr, 8);
+            const char type = header[156];
+            if ((type == '0' || type == '\0') && EndsWith(name, ".obj")) {
+                headerBytes = 0;
+                remaining = size;
+                return true;
+            }
+            const uint64_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK;
+            if (gzseek(file_, z_off_t(padded * TAR_BLOCK), SEEK_CUR) < 0 ||
+                !Read(header, TAR_BLOCK) || header[0] == '\0') {
+                cerr << "No .obj member in tar archive" << endl;
+                return false;
+            }
+        }
+    }
+
+    void Inflate() {
+        char header[TAR_BLOCK];
+        size_t headerBytes = 0;
+        uint64_t remaining = ~uint64_t(0);
+        bool ok = SkipTarHeaders(header, headerBytes, remaining);
+        while (ok && remaining > 0) {
+            size_t chunk = NONE;
+            {
+                unique_lock<mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return !free_.empty() || cancel_; });
+                if (cancel_) break;
+                chunk = free_.front();
+                free_.pop_front();
+            }
+            vector<char>& data = chunks_[chunk];
+            memcpy(data.data(), header, headerBytes);
+            const size_t request =
+                size_t(min<uint64_t>(data.size() - headerBytes, remaining));
+            const int n = gzread(file_, data.data() + headerBytes,
+                                 unsigned(request));
+            ok = n >= 0;
+            const size_t size = headerBytes + size_t(max(n, 0));
+            headerBytes = 0;
+            remaining -= size_t(max(n, 0));
+            if (n == 0) remaining = 0;
+            inflated_ += size;
+            lock_guard<mutex> lock(mutex_);
+            if (size > 0) {
+                full_.push_back({chunk, size});
+            } else {
+                free_.push_back(chunk);
+            }
+            cv_.notify_all();
+        }
+        lock_guard<mutex> lock(mutex_);
+        if (!ok) {
+            int errnum = 0;
+            cerr << "gzip: " << gzerror(file_, &errnum) << endl;
+            error_ = true;
+        }
+        done_ = true;
+        cv_.notify_all();
+    }
+
+    gzFile file_ = nullptr;
+    thread worker_;
+    mutex mutex_;
+    condition_variable cv_;
+    vector<vector<char>> chunks_;
+    deque<size_t> free_;
+    deque<pair<size_t, size_t>> full_;  // chunk index, valid bytes
+    size_t current_ = NONE;
+    size_t inflated_ = 0;
+    bool done_ = false;
+    bool cancel_ = false;
+    bool error_ = false;
+};
+
 //==============================================================================
 //------------------------------------------------------------------------------
 struct Vertex {
@@ -595,9 +1291,81 @@ struct Vertex {
     float tu, tv;
 };
 
+// 16 bytes: position as unorm16 within the mesh bounds, octahedral normal
+// as snorm16x2, texture coordinates as half floats
+struct QuantizedVertex {
+    uint16_t vx, vy, vz, vw;
+    uint32_t normal;
+    uint16_t tu, tv;
+};
+
+enum VertexFormat : uint32_t {
+    VERTEX_FORMAT_FLOAT = 0,
+    VERTEX_FORMAT_QUANTIZED = 1
+};
+
+uint32_t VertexSize(VertexFormat format) {
+    return format == VERTEX_FORMAT_QUANTIZED ? sizeof(QuantizedVertex)
+                                             : sizeof(Vertex);
+}
+
+// Position stream entry of the depth prepass: three floats, or the four
+// unorm16 of QuantizedVertex, decoded exactly like the full vertex
+uint32_t PositionSize(VertexFormat format) {
+    return format == VERTEX_FORMAT_QUANTIZED ? 4 * sizeof(uint16_t)
+                                             : 3 * sizeof(float);
+}
+
+// Range of the index buffer drawing one level of detail; error is the
+// simplification error in mesh units
+struct MeshLod {
+    uint32_t indexOffset;
+    uint32_t indexCount;
+    float error;
+    uint32_t meshletOffset;
+    uint32_t meshletCount;
+};
+
+// Cluster of up to MAX_MESHLET_VERTICES vertices and MAX_MESHLET_TRIANGLES
+// triangles with its bounding sphere and normal cone, laid out for std430.
+// Its triangles are also indices [indexOffset, indexOffset + 3 *
+// triangleCount) of the index buffer, so clusters can be drawn by range.
+struct Meshlet {
+    float center[3];
+    float radius;
+    float coneApex[3];
+    float coneCutoff;
+    float coneAxis[3];
+    uint32_t indexOffset;
+    // into Mesh::meshletVertices and Mesh::meshletTriangles (bytes)
+    uint32_t vertexOffset;
+    uint32_t triangleOffset;
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+};
+
+const size_t MAX_MESHLET_VERTICES = 64;
+const size_t MAX_MESHLET_TRIANGLES = 124;
+
+// including the full resolution level
+const uint32_t MAX_LODS = 8;
+
 struct Mesh {
     vector<Vertex> vertices;
+    // all levels of detail, back to back
     vector<uint32_t> indices;
+    vector<MeshLod> lods;
+    vector<Meshlet> meshlets;
+    // vertex buffer indices of each meshlet
+    vector<uint32_t> meshletVertices;
+    // meshlet local vertex indices, 3 per triangle, each meshlet 4 aligned
+    vector<uint8_t> meshletTriangles;
+    // filled from vertices when the quantized format is selected
+    vector<QuantizedVertex> quantized;
+    // indices into the position stream, which has PositionSize(format) bytes
+    // for each vertex: vertices sharing a position share an index
+    vector<uint32_t> shadowIndices;
+    vector<uint8_t> positions;
 };
 
 union Triangle {
@@ -605,6 +1373,26 @@ union Triangle {
     char data[sizeof(Vertex) * 3];
 };
 
+// Index triple of an obj face corner, -1 when an attribute is absent
+struct ObjIndex {
+    int position;
+    int normal;
+    int texCoord;
+    bool operator==(const ObjIndex& other) const {
+        return position == other.position && normal == other.normal &&
+               texCoord == other.texCoord;
+    }
+};
+
+struct ObjIndexHash {
+    size_t operator()(const ObjIndex& i) const {
+        uint64_t h = uint32_t(i.position);
+        h = h * 0x9E3779B97F4A7C15ull ^ uint32_t(i.normal);
+        h = h * 0x9E3779B97F4A7C15ull ^ uint32_t(i.texCoord);
+        return size_t(h ^ (h >> 32));
+    }
+};
+
 struct VertexProperties {
     bool normal = false;
     bool texCoord = false;
@@ -612,32 +1400,259 @@ struct VertexProperties {
     operator bool() const { return valid; }
 };
 
-VertexProperties LoadMesh(Mesh& result, const char* path) {
-    std::string inputfile = path;
-    tinyobj::ObjReaderConfig reader_config;
-    reader_config.mtl_search_path = "./";  // Path to material files
+struct MappedFile {
+    void* data = nullptr;
+    size_t size = 0;
+};
+
+bool MapFile(MappedFile& file, const string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd,
+                    0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    file.data = data;
+    file.size = size_t(st.st_size);
+    return true;
+}
+
+void UnmapFile(MappedFile& file) {
+    if (file.data) munmap(file.data, file.size);
+    file = MappedFile();
+}
 
-    tinyobj::ObjReader reader;
+// Appends the inflated contents of a gzip or tar.gz file to data
+bool InflateToMemory(GzStreamBuf& buf, vector<char>& data) {
+    for (int c = buf.sgetc(); c != EOF; c = buf.sgetc()) {
+        const size_t n = size_t(buf.in_avail());
+        data.resize(data.size() + n);
+        buf.sgetn(data.data() + data.size() - n, streamsize(n));
+    }
+    return !buf.Error();
+}
 
-    if (!reader.ParseFromFile(inputfile, reader_config)) {
-        if (!reader.Error().empty()) {
-            std::cerr << "TinyObjReader: " << reader.Error();
+// Plain files are memory mapped and tokenized in place. Compressed files are
+// parsed while inflating by the serial stream reader with threads <= 1,
+// otherwise inflated to memory for the chunked parallel parser.
+bool ParseObj(const char* path, unsigned threads, tinyobj::attrib_t& attrib,
+              vector<tinyobj::shape_t>& shapes) {
+    if (EndsWith(path, ".gz")) {
+        GzStreamBuf buf(path);
+        std::string warn, err;
+        bool ok = false;
+        if (threads > 1) {
+            // the parallel parser needs random access: inflate to memory
+            vector<char> data;
+            ok = InflateToMemory(buf, data) &&
+                 tinyobj::LoadObjParallel(&attrib, &shapes, &warn, &err,
+                                          data.data(), data.size(), threads);
+        } else {
+            std::istream stream(&buf);
+            vector<tinyobj::material_t> materials;
+            ok = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
+                                  &stream) &&
+                 !buf.Error();
         }
-        exit(1);
+        if (!warn.empty()) std::cout << "TinyObjReader: " << warn;
+        if (!err.empty()) std::cerr << "TinyObjReader: " << err;
+        cout << "Inflated " << buf.BytesInflated() / 1024 << " KB" << endl;
+        return ok;
+    }
+    MappedFile file;
+    if (!MapFile(file, path)) {
+        std::cerr << "Cannot map " << path << endl;
+        return false;
     }
+    std::string warn, err;
+    const bool ok = tinyobj::LoadObjParallel(
+        &attrib, &shapes, &warn, &err, static_cast<const char*>(file.data),
+        file.size, max(threads, 1u));
+    UnmapFile(file);
+    if (!warn.empty()) std::cout << "LoadObjParallel: " << warn;
+    if (!err.empty()) std::cerr << "LoadObjParallel: " << err;
+    return ok;
+}
+
+enum ObjLoader : uint32_t { OBJ_LOADER_TINYOBJ = 0, OBJ_LOADER_FAST_OBJ = 1 };
+
+const char* ObjLoaderString(ObjLoader loader) {
+    return loader == OBJ_LOADER_FAST_OBJ ? "fast_obj" : "tinyobj";
+}
+
+// Writes the inflated contents of a gzip or tar.gz file to fd
+bool InflateToFile(const char* path, int fd) {
+    GzStreamBuf buf(path);
+    vector<char> chunk(1 << 16);
+    bool ok = true;
+    for (streamsize n; ok && (n = buf.sgetn(chunk.data(), chunk.size())) > 0;) {
+        ok = write(fd, chunk.data(), size_t(n)) == n;
+    }
+    return ok && !buf.Error();
+}
+
+// fast_obj reads plain files only: gzip sources go through a temporary file
+fastObjMesh* ReadFastObj(const char* path) {
+    if (!EndsWith(path, ".gz")) return fast_obj_read(path);
+    char tmpPath[] = "/tmp/meshXXXXXX";
+    const int fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        perror("mkstemp() error");
+        return nullptr;
+    }
+    const bool ok = InflateToFile(path, fd);
+    close(fd);
+    fastObjMesh* mesh = ok ? fast_obj_read(tmpPath) : nullptr;
+    unlink(tmpPath);
+    return mesh;
+}
+
+// Pre-scans a gzip source while inflating it, a run of whole lines at a
+// time, so that the inflated file is never held in memory or on disk
+bool CountGzObj(tinyobj::obj_counts_t& counts, const char* path) {
+    GzStreamBuf buf(path);
+    counts = {};
+    vector<char> data;
+    size_t scanned = 0;
+    for (bool more = true; more;) {
+        more = buf.sgetc() != EOF;
+        if (more) {
+            const size_t n = size_t(buf.in_avail());
+            data.resize(data.size() + n);
+            buf.sgetn(data.data() + data.size() - n, streamsize(n));
+        }
+        // up to the last newline, or everything at the end of the stream
+        size_t lines = data.size();
+        while (more && lines > scanned && data[lines - 1] != '\n') --lines;
+        if (more && lines == scanned) {
+            scanned = data.size();
+            continue;
+        }
+        tinyobj::obj_counts_t run;
+        tinyobj::CountObj(&run, data.data(), lines);
+        counts.num_vertices += run.num_vertices;
+        counts.num_normals += run.num_normals;
+        counts.num_texcoords += run.num_texcoords;
+        counts.num_faces += run.num_faces;
+        counts.num_indices += run.num_indices;
+        data.erase(data.begin(), data.begin() + lines);
+        scanned = data.size();
+    }
+    return !buf.Error();
+}
+
+// Read only stream over memory, e.g. a mapped file
+class MemoryStreamBuf : public std::streambuf {
+  public:
+    MemoryStreamBuf(const void* data, size_t size) {
+        char* begin = static_cast<char*>(const_cast<void*>(data));
+        setg(begin, begin, begin + size);
+    }
+};
+
+VertexProperties MeshProperties(Mesh& result, size_t corners,
+                                size_t positions, bool normal,
+                                bool texCoord) {
+    cout << "Vertices: " << result.vertices.size() << " unique of " << corners
+         << " corners ("
+         << 100.0 * result.vertices.size() / max(corners, size_t(1))
+         << "%), " << positions << " positions" << endl;
+
+    result.lods = {{0, uint32_t(result.indices.size()), 0, 0, 0}};
+
+    VertexProperties vp;
+    vp.valid = result.vertices.size() > 0;
+    vp.normal = normal;
+    vp.texCoord = texCoord;
+    return vp;
+}
+
+// Converts the flat fast_obj arrays straight into mesh, polygons as fans
+VertexProperties LoadMeshFastObj(Mesh& result, const char* path) {
+    const double parseStart = glfwGetTime();
+    fastObjMesh* obj = ReadFastObj(path);
+    if (!obj) {
+        cerr << "fast_obj cannot read " << path << endl;
+        return VertexProperties();
+    }
+    cout << "Parsed " << path << " in "
+         << (glfwGetTime() - parseStart) * 1000 << " ms (fast_obj)" << endl;
+
+    size_t totalIndices = 0;
+    for (unsigned f = 0; f != obj->face_count; ++f) {
+        totalIndices += 3 * (max(obj->face_vertices[f], 2u) - 2);
+    }
+    unordered_map<ObjIndex, uint32_t, ObjIndexHash> remap;
+    remap.reserve(totalIndices);
+    result.vertices.reserve(obj->position_count);
+    result.indices.reserve(totalIndices);
+    bool normal = false;
+    bool texCoord = false;
+    // attribute index 0 is a dummy standing for an absent attribute
+    const auto vertexIndex = [&](const fastObjIndex& i) {
+        const ObjIndex key = {int(i.p) - 1, int(i.n) - 1, int(i.t) - 1};
+        auto inserted = remap.insert({key, uint32_t(result.vertices.size())});
+        if (inserted.second) {
+            normal = normal || i.n > 0;
+            texCoord = texCoord || i.t > 0;
+            const float* p = &obj->positions[3 * i.p];
+            const float* n = &obj->normals[3 * i.n];
+            const float* t = &obj->texcoords[2 * i.t];
+            Vertex vert = {.vx = p[0],
+                           .vy = p[1],
+                           .vz = p[2],
+                           .nx = i.n > 0 ? n[0] : 0,
+                           .ny = i.n > 0 ? n[1] : 0,
+                           .nz = i.n > 0 ? n[2] : 0,
+                           .tu = t[0],
+                           .tv = t[1]};
+            result.vertices.push_back(vert);
+        }
+        return inserted.first->second;
+    };
+    size_t offset = 0;
+    for (unsigned f = 0; f != obj->face_count; ++f) {
+        const unsigned count = obj->face_vertices[f];
+        for (unsigned v = 2; v < count; ++v) {
+            result.indices.push_back(vertexIndex(obj->indices[offset]));
+            result.indices.push_back(vertexIndex(obj->indices[offset + v - 1]));
+            result.indices.push_back(vertexIndex(obj->indices[offset + v]));
+        }
+        offset += count;
+    }
+    const size_t positions = obj->position_count - 1;
+    fast_obj_destroy(obj);
+    return MeshProperties(result, totalIndices, positions, normal, texCoord);
+}
 
-    if (!reader.Warning().empty()) {
-        std::cout << "TinyObjReader: " << reader.Warning();
+// threads only apply to tinyobj
+VertexProperties LoadMesh(Mesh& result, const char* path,
+                          unsigned threads = 1,
+                          ObjLoader loader = OBJ_LOADER_TINYOBJ) {
+    if (loader == OBJ_LOADER_FAST_OBJ) return LoadMeshFastObj(result, path);
+    tinyobj::attrib_t attrib;
+    vector<tinyobj::shape_t> shapes;
+    const double parseStart = glfwGetTime();
+    if (!ParseObj(path, threads, attrib, shapes)) {
+        return VertexProperties();
     }
+    cout << "Parsed " << path << " in "
+         << (glfwGetTime() - parseStart) * 1000 << " ms (" << max(threads, 1u)
+         << (threads > 1 ? " threads)" : " thread)") << endl;
 
-    auto& attrib = reader.GetAttrib();
-    auto& shapes = reader.GetShapes();
-    auto& materials = reader.GetMaterials();
     size_t totalIndices = 0;
-    for (auto s : shapes) {
+    for (const auto& s : shapes) {
         totalIndices += s.mesh.indices.size();
     }
-    result.vertices.resize(attrib.vertices.size() / 3);
+    // one output vertex per distinct (position, normal, uv) index triple
+    unordered_map<ObjIndex, uint32_t, ObjIndexHash> remap;
+    remap.reserve(totalIndices);
+    result.vertices.reserve(attrib.vertices.size() / 3);
+    result.indices.reserve(totalIndices);
     bool normal = false;
     bool texCoord = false;
     // Loop over shapes
@@ -655,9 +1670,14 @@ VertexProperties LoadMesh(Mesh& result, const char* path) {
                 const ssize_t tidx = idx.texcoord_index;
                 if (nidx >= 0) normal = true;
                 if (tidx >= 0) texCoord = true;
-                tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
-                tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
-                tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
+                const ObjIndex key = {int(vidx), int(nidx), int(tidx)};
+                auto inserted =
+                    remap.insert({key, uint32_t(result.vertices.size())});
+                result.indices.push_back(inserted.first->second);
+                if (!inserted.second) continue;
+                tinyobj::real_t vx = attrib.vertices[3 * vidx + 0];
+                tinyobj::real_t vy = attrib.vertices[3 * vidx + 1];
+                tinyobj::real_t vz = attrib.vertices[3 * vidx + 2];
                 tinyobj::real_t nx =
                     nidx >= 0 ? attrib.normals[3 * nidx + 0] : 0;
                 tinyobj::real_t ny =
@@ -680,8 +1700,7 @@ VertexProperties LoadMesh(Mesh& result, const char* path) {
                                .nz = nz,
                                .tu = tx,
                                .tv = ty};
-                result.vertices[idx.vertex_index] = vert;
-                result.indices.push_back(idx.vertex_index);
+                result.vertices.push_back(vert);
             }
             index_offset += fv;
 
@@ -689,39 +1708,1083 @@ VertexProperties LoadMesh(Mesh& result, const char* path) {
             // shapes[s].mesh.material_ids[f];
         }
     }
-
-    VertexProperties vp;
-    vp.valid = result.vertices.size() > 0;
-    vp.normal = normal;
-    vp.texCoord = texCoord;
-    return vp;
+    return MeshProperties(result, totalIndices, attrib.vertices.size() / 3,
+                          normal, texCoord);
 }
 
 //------------------------------------------------------------------------------
+enum MeshOptimization : uint32_t {
+    OPTIMIZE_VERTEX_CACHE = 1,
+    OPTIMIZE_OVERDRAW = 2,
+    OPTIMIZE_VERTEX_FETCH = 4,
+    OPTIMIZE_ALL = 7
+};
 
-uint32_t SelectMemoryType(const VkPhysicalDeviceMemoryProperties& memProps,
-                          uint32_t memTypeBits, VkMemoryPropertyFlags flags) {
-    for (uint32_t i = 0; i != memProps.memoryTypeCount; ++i) {
-        if ((memTypeBits & (1 << i)) != 0 &&
-            (memProps.memoryTypes[i].propertyFlags & flags) == flags) {
-            return i;
+void PrintVertexCacheStats(const char* label, const Mesh& mesh) {
+    const MeshLod& lod = mesh.lods[0];
+    const meshopt_VertexCacheStatistics stats = meshopt_analyzeVertexCache(
+        &mesh.indices[lod.indexOffset], lod.indexCount, mesh.vertices.size(),
+        16, 0, 0);
+    cout << label << " ACMR " << stats.acmr << ", ATVR " << stats.atvr
+         << endl;
+}
+
+// Reorders the triangles of the full resolution level for the post
+// transform cache, then for overdraw; each stage is optional
+void OptimizeMesh(Mesh& mesh, uint32_t optimizations) {
+    optimizations &= OPTIMIZE_VERTEX_CACHE | OPTIMIZE_OVERDRAW;
+    if (optimizations == 0) return;
+    const double start = glfwGetTime();
+    PrintVertexCacheStats("Before optimization:", mesh);
+    uint32_t* indices = &mesh.indices[mesh.lods[0].indexOffset];
+    const size_t indexCount = mesh.lods[0].indexCount;
+    const size_t vertexCount = mesh.vertices.size();
+    if (optimizations & OPTIMIZE_VERTEX_CACHE) {
+        meshopt_optimizeVertexCache(indices, indices, indexCount,
+                                    vertexCount);
+    }
+    if (optimizations & OPTIMIZE_OVERDRAW) {
+        // allow 5% more vertex transforms in exchange for less overdraw
+        meshopt_optimizeOverdraw(indices, indices, indexCount,
+                                 &mesh.vertices[0].vx, vertexCount,
+                                 sizeof(Vertex), 1.05f);
+    }
+    PrintVertexCacheStats("After optimization: ", mesh);
+    cout << "Optimized mesh in " << (glfwGetTime() - start) * 1000 << " ms"
+         << endl;
+}
+
+// Reorders vertices in the order all levels of detail first reference them
+void OptimizeVertexFetch(Mesh& mesh) {
+    vector<Vertex> vertices(mesh.vertices.size());
+    const size_t n = meshopt_optimizeVertexFetch(
+        vertices.data(), mesh.indices.data(), mesh.indices.size(),
+        mesh.vertices.data(), mesh.vertices.size(), sizeof(Vertex));
+    vertices.resize(n);
+    mesh.vertices.swap(vertices);
+}
+
+// Appends one level of detail per ratio of the full resolution triangle
+// count, each simplified from the previous one. Falls back to sloppy
+// simplification when topology keeps meshopt_simplify above its target.
+void GenerateLods(Mesh& mesh, const vector<float>& ratios,
+                  bool optimizeVertexCache) {
+    const double start = glfwGetTime();
+    const float* positions = &mesh.vertices[0].vx;
+    const size_t vertexCount = mesh.vertices.size();
+    const float scale =
+        meshopt_simplifyScale(positions, vertexCount, sizeof(Vertex));
+    const size_t fullCount = mesh.lods[0].indexCount;
+    vector<uint32_t> source(mesh.indices.begin(),
+                            mesh.indices.begin() + fullCount);
+    vector<uint32_t> lod(fullCount);
+    float error = 0;
+    for (float ratio : ratios) {
+        if (mesh.lods.size() == MAX_LODS) break;
+        const size_t target = size_t(fullCount * ratio) / 3 * 3;
+        float lodError = 0;
+        size_t count = meshopt_simplify(
+            lod.data(), source.data(), source.size(), positions, vertexCount,
+            sizeof(Vertex), target, 1e-1f, 0, &lodError);
+        if (count > target + target / 2) {
+            count = meshopt_simplifySloppy(
+                lod.data(), source.data(), source.size(), positions,
+                vertexCount, sizeof(Vertex), target, 1e-1f, &lodError);
+        }
+        if (count == 0 || count >= source.size()) break;
+        if (optimizeVertexCache) {
+            meshopt_optimizeVertexCache(lod.data(), lod.data(), count,
+                                        vertexCount);
         }
+        // each level is simplified from the previous one, so its error is
+        // relative to it: the sum bounds the error from full resolution
+        error += lodError * scale;
+        mesh.lods.push_back(
+            {uint32_t(mesh.indices.size()), uint32_t(count), error, 0, 0});
+        mesh.indices.insert(mesh.indices.end(), lod.begin(),
+                            lod.begin() + count);
+        source.assign(lod.begin(), lod.begin() + count);
     }
-    assert(!"No compatible memory type found");
-    return ~0u;
+    for (size_t i = 0; i != mesh.lods.size(); ++i) {
+        cout << "LOD " << i << ": " << mesh.lods[i].indexCount / 3
+             << " triangles, error " << mesh.lods[i].error << endl;
+    }
+    cout << "Generated LODs in " << (glfwGetTime() - start) * 1000 << " ms"
+         << endl;
 }
 
-//------------------------------------------------------------------------------
+// Coarsest level whose error projects to at most threshold pixels. The camera
+// has a 90 degree vertical field of view, so at distance 1 a unit spans half
+// the framebuffer height.
+uint32_t SelectLod(const vector<MeshLod>& lods, float distance,
+                   uint32_t height, float threshold) {
+    const float pixelsPerUnit = 0.5f * height / max(distance, 1e-3f);
+    uint32_t selected = 0;
+    for (uint32_t i = 1; i < lods.size(); ++i) {
+        if (lods[i].error * pixelsPerUnit <= threshold) selected = i;
+    }
+    return selected;
+}
+
+// Splits every level of detail into meshlets and rewrites its index range in
+// meshlet order
+void BuildMeshlets(Mesh& mesh) {
+    const double start = glfwGetTime();
+    const float* positions = &mesh.vertices[0].vx;
+    const size_t vertexCount = mesh.vertices.size();
+    mesh.meshlets.clear();
+    mesh.meshletVertices.clear();
+    mesh.meshletTriangles.clear();
+    for (MeshLod& lod : mesh.lods) {
+        const size_t bound = meshopt_buildMeshletsBound(
+            lod.indexCount, MAX_MESHLET_VERTICES, MAX_MESHLET_TRIANGLES);
+        vector<meshopt_Meshlet> meshlets(bound);
+        vector<uint32_t> vertices(bound * MAX_MESHLET_VERTICES);
+        vector<uint8_t> triangles(bound * MAX_MESHLET_TRIANGLES * 3);
+        const size_t count = meshopt_buildMeshlets(
+            meshlets.data(), vertices.data(), triangles.data(),
+            &mesh.indices[lod.indexOffset], lod.indexCount, positions,
+            vertexCount, sizeof(Vertex), MAX_MESHLET_VERTICES,
+            MAX_MESHLET_TRIANGLES, 0.25f);
+        lod.meshletOffset = uint32_t(mesh.meshlets.size());
+        lod.meshletCount = uint32_t(count);
+        const uint32_t vertexBase = uint32_t(mesh.meshletVertices.size());
+        const uint32_t triangleBase = uint32_t(mesh.meshletTriangles.size());
+        uint32_t index = lod.indexOffset;
+        for (size_t i = 0; i != count; ++i) {
+            const meshopt_Meshlet& m = meshlets[i];
+            const uint32_t* v = &vertices[m.vertex_offset];
+            const uint8_t* t = &triangles[m.triangle_offset];
+            const meshopt_Bounds bounds = meshopt_computeMeshletBounds(
+                v, t, m.triangle_count, positions, vertexCount,
+                sizeof(Vertex));
+            Meshlet meshlet = {.radius = bounds.radius,
+                               .coneCutoff = bounds.cone_cutoff,
+                               .indexOffset = index,
+                               .vertexOffset = vertexBase + m.vertex_offset,
+                               .triangleOffset =
+                                   triangleBase + m.triangle_offset,
+                               .vertexCount = m.vertex_count,
+                               .triangleCount = m.triangle_count};
+            memcpy(meshlet.center, bounds.center, sizeof(meshlet.center));
+            memcpy(meshlet.coneApex, bounds.cone_apex,
+                   sizeof(meshlet.coneApex));
+            memcpy(meshlet.coneAxis, bounds.cone_axis,
+                   sizeof(meshlet.coneAxis));
+            mesh.meshlets.push_back(meshlet);
+            for (uint32_t j = 0; j != m.triangle_count * 3; ++j) {
+                mesh.indices[index++] = v[t[j]];
+            }
+        }
+        if (count > 0) {
+            const meshopt_Meshlet& last = meshlets[count - 1];
+            mesh.meshletVertices.insert(
+                mesh.meshletVertices.end(), vertices.begin(),
+                vertices.begin() + last.vertex_offset + last.vertex_count);
+            mesh.meshletTriangles.insert(
+                mesh.meshletTriangles.end(), triangles.begin(),
+                triangles.begin() + last.triangle_offset +
+                    ((last.triangle_count * 3 + 3) & ~3u));
+        }
+    }
+    cout << "Meshlets: " << mesh.meshlets.size() << " ("
+         << mesh.lods[0].meshletCount << " at full resolution), built in "
+         << (glfwGetTime() - start) * 1000 << " ms" << endl;
+}
+
+// Index buffer for position only passes, same layout as the final one
+void GenerateShadowIndices(Mesh& mesh) {
+    const double start = glfwGetTime();
+    mesh.shadowIndices.resize(mesh.indices.size());
+    meshopt_generateShadowIndexBuffer(
+        mesh.shadowIndices.data(), mesh.indices.data(), mesh.indices.size(),
+        &mesh.vertices[0].vx, mesh.vertices.size(), 3 * sizeof(float),
+        sizeof(Vertex));
+    const MeshLod& lod = mesh.lods[0];
+    const meshopt_VertexCacheStatistics stats = meshopt_analyzeVertexCache(
+        &mesh.shadowIndices[lod.indexOffset], lod.indexCount,
+        mesh.vertices.size(), 16, 0, 0);
+    cout << "Shadow indices ACMR " << stats.acmr << ", generated in "
+         << (glfwGetTime() - start) * 1000 << " ms" << endl;
+}
+
+//------------------------------------------------------------------------------
+// Binary mesh cache: a header followed by the level of detail table, the
+// meshlets, the final vertex, index and shadow index arrays, the meshlet
+// vertices, the position stream and the meshlet triangles, written after the
+// first parse and mapped on later runs.
+const uint32_t MESH_CACHE_MAGIC = 0x4853454d;  // "MESH"
+// bump whenever the header or the Vertex layout changes
+const uint32_t MESH_CACHE_VERSION = 7;
+
+struct MeshCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertexSize;
+    uint32_t indexSize;
+    // MeshOptimization bits applied to the cached arrays
+    uint32_t optimizations;
+    uint32_t vertexFormat;
+    // size and content hash of the source file the cache was built from
+    uint64_t sourceSize;
+    uint64_t sourceHash;
+    uint64_t vertexCount;
+    uint64_t indexCount;
+    float boundsMin[3];
+    float boundsMax[3];
+    uint32_t lodCount;
+    // requested ratios of the coarser levels, unused entries are zero
+    float lodRatios[MAX_LODS - 1];
+    uint64_t meshletCount;
+    uint64_t meshletVertexCount;
+    uint64_t meshletTriangleBytes;
+};
+
+// Everything the cached arrays depend on
+struct MeshCacheKey {
+    uint64_t sourceSize;
+    uint64_t sourceHash;
+    uint32_t optimizations;
+    VertexFormat vertexFormat;
+    vector<float> lodRatios;
+};
+
+void CacheLodRatios(const MeshCacheKey& key, float ratios[MAX_LODS - 1]) {
+    for (uint32_t i = 0; i != MAX_LODS - 1; ++i) {
+        ratios[i] = i < key.lodRatios.size() ? key.lodRatios[i] : 0;
+    }
+}
+
+// Final vertex and index arrays, pointing either into a Mesh or into a
+// mapped cache file
+struct MeshView {
+    VertexFormat vertexFormat = VERTEX_FORMAT_FLOAT;
+    const void* vertices = nullptr;
+    size_t vertexCount = 0;
+    const uint32_t* indices = nullptr;
+    size_t indexCount = 0;
+    // indexCount shadow indices, vertexCount positions
+    const uint32_t* shadowIndices = nullptr;
+    const void* positions = nullptr;
+    const MeshLod* lods = nullptr;
+    size_t lodCount = 0;
+    const Meshlet* meshlets = nullptr;
+    size_t meshletCount = 0;
+    const uint32_t* meshletVertices = nullptr;
+    size_t meshletVertexCount = 0;
+    const uint8_t* meshletTriangles = nullptr;
+    size_t meshletTriangleBytes = 0;
+    float boundsMin[3] = {};
+    float boundsMax[3] = {};
+};
+
+// crc32 and adler32 of the file contents combined into 64 bits
+bool HashFile(const string& path, uint64_t& size, uint64_t& hash) {
+    MappedFile file;
+    if (!MapFile(file, path)) return false;
+    const Bytef* data = static_cast<const Bytef*>(file.data);
+    uLong crc = crc32(0, Z_NULL, 0);
+    uLong adler = adler32(0, Z_NULL, 0);
+    for (size_t offset = 0; offset < file.size; offset += 1 << 30) {
+        const uInt n = uInt(min(file.size - offset, size_t(1) << 30));
+        crc = crc32(crc, data + offset, n);
+        adler = adler32(adler, data + offset, n);
+    }
+    size = file.size;
+    hash = (uint64_t(adler) << 32) | uint64_t(crc);
+    UnmapFile(file);
+    return true;
+}
+
+// Octahedral mapping of a unit vector to snorm16x2, x in the low half as
+// expected by unpackSnorm2x16
+uint32_t OctEncode(float x, float y, float z) {
+    const float l1 = fabsf(x) + fabsf(y) + fabsf(z);
+    if (l1 == 0) return 0;
+    float u = x / l1;
+    float v = y / l1;
+    if (z < 0) {
+        const float fu = (1 - fabsf(v)) * (u >= 0 ? 1 : -1);
+        const float fv = (1 - fabsf(u)) * (v >= 0 ? 1 : -1);
+        u = fu;
+        v = fv;
+    }
+    return (uint32_t(meshopt_quantizeSnorm(u, 16)) & 0xffff) |
+           (uint32_t(meshopt_quantizeSnorm(v, 16)) << 16);
+}
+
+void QuantizeMesh(Mesh& mesh, const float boundsMin[3],
+                  const float boundsMax[3]) {
+    float invExtent[3];
+    for (int i = 0; i != 3; ++i) {
+        const float extent = boundsMax[i] - boundsMin[i];
+        invExtent[i] = extent > 0 ? 1 / extent : 0;
+    }
+    mesh.quantized.resize(mesh.vertices.size());
+    for (size_t i = 0; i != mesh.vertices.size(); ++i) {
+        const Vertex& v = mesh.vertices[i];
+        QuantizedVertex& q = mesh.quantized[i];
+        q.vx = uint16_t(meshopt_quantizeUnorm(
+            (v.vx - boundsMin[0]) * invExtent[0], 16));
+        q.vy = uint16_t(meshopt_quantizeUnorm(
+            (v.vy - boundsMin[1]) * invExtent[1], 16));
+        q.vz = uint16_t(meshopt_quantizeUnorm(
+            (v.vz - boundsMin[2]) * invExtent[2], 16));
+        q.vw = 0;
+        q.normal = OctEncode(v.nx, v.ny, v.nz);
+        q.tu = meshopt_quantizeHalf(v.tu);
+        q.tv = meshopt_quantizeHalf(v.tv);
+    }
+}
+
+MeshView MakeMeshView(Mesh& mesh, VertexFormat format) {
+    MeshView view;
+    view.vertexFormat = format;
+    view.vertices = mesh.vertices.data();
+    view.vertexCount = mesh.vertices.size();
+    view.indices = mesh.indices.data();
+    view.indexCount = mesh.indices.size();
+    view.lods = mesh.lods.data();
+    view.lodCount = mesh.lods.size();
+    view.meshlets = mesh.meshlets.data();
+    view.meshletCount = mesh.meshlets.size();
+    view.meshletVertices = mesh.meshletVertices.data();
+    view.meshletVertexCount = mesh.meshletVertices.size();
+    view.meshletTriangles = mesh.meshletTriangles.data();
+    view.meshletTriangleBytes = mesh.meshletTriangles.size();
+    for (int i = 0; i != 3; ++i) {
+        view.boundsMin[i] = mesh.vertices.empty() ? 0 : FLT_MAX;
+        view.boundsMax[i] = mesh.vertices.empty() ? 0 : -FLT_MAX;
+    }
+    for (const Vertex& v : mesh.vertices) {
+        const float p[3] = {v.vx, v.vy, v.vz};
+        for (int i = 0; i != 3; ++i) {
+            view.boundsMin[i] = min(view.boundsMin[i], p[i]);
+            view.boundsMax[i] = max(view.boundsMax[i], p[i]);
+        }
+    }
+    if (format == VERTEX_FORMAT_QUANTIZED) {
+        QuantizeMesh(mesh, view.boundsMin, view.boundsMax);
+        view.vertices = mesh.quantized.data();
+    }
+    const size_t positionSize = PositionSize(format);
+    mesh.positions.resize(positionSize * mesh.vertices.size());
+    for (size_t i = 0; i != mesh.vertices.size(); ++i) {
+        const void* p = format == VERTEX_FORMAT_QUANTIZED
+                            ? static_cast<const void*>(&mesh.quantized[i].vx)
+                            : static_cast<const void*>(&mesh.vertices[i].vx);
+        memcpy(&mesh.positions[i * positionSize], p, positionSize);
+    }
+    view.shadowIndices = mesh.shadowIndices.data();
+    view.positions = mesh.positions.data();
+    return view;
+}
+
+//------------------------------------------------------------------------------
+// Meshes packed into shared arenas, one vertex buffer, one index buffer and so
+// on for all of them, drawn with one pipeline bind and one descriptor push
+
+// Decodes the quantized positions of a mesh: offset + scale * unorm16, read
+// by the vertex shaders at the mesh index of a draw
+struct Quantization {
+    float offset[4];
+    float scale[4];
+};
+
+Quantization MakeQuantization(const float boundsMin[3],
+                              const float boundsMax[3]) {
+    Quantization q = {};
+    for (int i = 0; i != 3; ++i) {
+        q.offset[i] = boundsMin[i];
+        q.scale[i] = (boundsMax[i] - boundsMin[i]) / 65535.0f;
+    }
+    return q;
+}
+
+// Draw range of one mesh in the arenas. Its indices, shadow indices and
+// meshlet vertices are relative to vertexOffset; lods and meshlets are
+// rebased to the arenas. Quantized positions keep the bounds of their mesh.
+struct SceneMesh {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    int32_t vertexOffset;
+    uint32_t meshletOffset;
+    uint32_t meshletCount;
+    vector<MeshLod> lods;
+    Quantization quantization;
+};
+
+struct Scene {
+    VertexFormat vertexFormat = VERTEX_FORMAT_FLOAT;
+    vector<uint8_t> vertices;
+    vector<uint32_t> indices;
+    // depth prepass streams, empty unless requested
+    vector<uint32_t> shadowIndices;
+    vector<uint8_t> positions;
+    vector<Meshlet> meshlets;
+    vector<uint32_t> meshletVertices;
+    vector<uint8_t> meshletTriangles;
+    vector<SceneMesh> meshes;
+    // largest distance of a vertex from the origin of its mesh
+    float radius = 0;
+};
+
+template <typename T>
+void Append(vector<T>& arena, const T* data, size_t count) {
+    arena.insert(arena.end(), data, data + count);
+}
+
+// Appends every view to the arenas of scene; views must share a vertex format.
+// prepass also packs the position streams and shadow indices.
+void BuildScene(Scene& scene, const vector<MeshView>& views, bool prepass) {
+    assert(!views.empty());
+    scene.vertexFormat = views[0].vertexFormat;
+    for (const MeshView& view : views) {
+        assert(view.vertexFormat == scene.vertexFormat);
+        float radius = 0;
+        for (int i = 0; i != 3; ++i) {
+            const float e =
+                max(fabsf(view.boundsMin[i]), fabsf(view.boundsMax[i]));
+            radius += e * e;
+        }
+        scene.radius = max(scene.radius, sqrtf(radius));
+    }
+    const size_t vertexSize = VertexSize(scene.vertexFormat);
+    const size_t positionSize = PositionSize(scene.vertexFormat);
+    for (const MeshView& view : views) {
+        SceneMesh mesh = {
+            .firstIndex = uint32_t(scene.indices.size()),
+            .indexCount = uint32_t(view.indexCount),
+            .vertexOffset = int32_t(scene.vertices.size() / vertexSize),
+            .meshletOffset = uint32_t(scene.meshlets.size()),
+            .meshletCount = uint32_t(view.meshletCount),
+            .quantization = MakeQuantization(view.boundsMin, view.boundsMax)};
+        for (size_t i = 0; i != view.lodCount; ++i) {
+            MeshLod lod = view.lods[i];
+            lod.indexOffset += mesh.firstIndex;
+            lod.meshletOffset += mesh.meshletOffset;
+            mesh.lods.push_back(lod);
+        }
+        const uint32_t meshletVertexOffset =
+            uint32_t(scene.meshletVertices.size());
+        const uint32_t meshletTriangleOffset =
+            uint32_t(scene.meshletTriangles.size());
+        for (size_t i = 0; i != view.meshletCount; ++i) {
+            Meshlet m = view.meshlets[i];
+            m.indexOffset += mesh.firstIndex;
+            m.vertexOffset += meshletVertexOffset;
+            m.triangleOffset += meshletTriangleOffset;
+            scene.meshlets.push_back(m);
+        }
+        Append(scene.vertices, static_cast<const uint8_t*>(view.vertices),
+               vertexSize * view.vertexCount);
+        Append(scene.indices, view.indices, view.indexCount);
+        Append(scene.meshletVertices, view.meshletVertices,
+               view.meshletVertexCount);
+        Append(scene.meshletTriangles, view.meshletTriangles,
+               view.meshletTriangleBytes);
+        if (prepass) {
+            Append(scene.shadowIndices, view.shadowIndices, view.indexCount);
+            Append(scene.positions, static_cast<const uint8_t*>(view.positions),
+                   positionSize * view.vertexCount);
+        }
+        scene.meshes.push_back(move(mesh));
+    }
+}
+
+// Mesh files of a scene: the .obj and .gz files of a directory in name order,
+// or the lines of a manifest, relative to its directory
+vector<string> ScenePaths(const string& path) {
+    vector<string> paths;
+    if (DIR* dir = opendir(path.c_str())) {
+        while (const dirent* entry = readdir(dir)) {
+            const string name = entry->d_name;
+            if (EndsWith(name, ".obj") || EndsWith(name, ".gz")) {
+                paths.push_back(path + "/" + name);
+            }
+        }
+        closedir(dir);
+        sort(paths.begin(), paths.end());
+        return paths;
+    }
+    ifstream manifest(path);
+    const string base = path.substr(0, path.find_last_of('/') + 1);
+    string line;
+    while (getline(manifest, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        paths.push_back(line[0] == '/' ? line : base + line);
+    }
+    return paths;
+}
+
+// Perspective camera distance units in front of the origin, looking down +z.
+// Reverse-Z with an infinite far plane: clip = (x * P00, y * P11, znear, z)
+// in view space, so depth = znear / z goes from 1 at the near plane to 0 at
+// infinity and keeps its precision far away.
+struct Camera {
+    float P00;
+    float P11;
+    float znear;
+    float distance;
+};
+
+Camera MakeCamera(float distance, uint32_t width, uint32_t height) {
+    // 1 / tan(fov / 2), 90 degrees as SelectLod assumes
+    const float f = 1;
+    return {f * float(height) / float(width), f, 0.01f, distance};
+}
+
+// Column major projection * view of camera, the clip space mapping above
+void MakeViewProjection(const Camera& camera, float m[16]) {
+    fill(m, m + 16, 0.0f);
+    m[0] = camera.P00;
+    m[5] = camera.P11;
+    m[11] = 1;
+    m[14] = camera.znear;
+    // view z = world z + distance
+    m[15] = camera.distance;
+}
+
+// Vertex shader push constants; indirect draws read their MeshDraw at
+// drawOffset + gl_DrawIDARB
+struct DrawData {
+    float viewProjection[16];
+    uint32_t drawOffset;
+};
+
+// Mesh to world transform of one instance: the top 3 rows of a row major
+// matrix, rotation and uniform scale only so that normals and bounding
+// spheres transform without an inverse
+struct Transform {
+    float rows[3][4];
+};
+
+// Indexed indirect command followed by per draw data, which the vertex shaders
+// read at gl_DrawIDARB: the transforms of a draw start at transformOffset, so
+// indirect draws leave firstInstance 0 and need no drawIndirectFirstInstance.
+// Direct draws see draw index 0 and push their own drawOffset instead.
+// meshIndex selects the Quantization of the mesh.
+struct MeshDraw {
+    VkDrawIndexedIndirectCommand command;
+    uint32_t transformOffset;
+    uint32_t meshIndex;
+};
+
+// One draw per run of consecutive instances of a mesh at the same level, lods
+// holds the level of every instance. Returns the draw count, at most
+// meshes.size() * instances.
+uint32_t MakeMeshDraws(MeshDraw* draws, const vector<SceneMesh>& meshes,
+                       const vector<uint32_t>& lods, uint32_t instances) {
+    uint32_t count = 0;
+    for (uint32_t m = 0; m != meshes.size(); ++m) {
+        for (uint32_t i = 0; i != instances;) {
+            const uint32_t first = m * instances + i;
+            uint32_t run = 1;
+            while (i + run != instances && lods[first + run] == lods[first]) {
+                ++run;
+            }
+            const MeshLod& lod = meshes[m].lods[lods[first]];
+            draws[count++] = {.command = {.indexCount = lod.indexCount,
+                                          .instanceCount = run,
+                                          .firstIndex = lod.indexOffset,
+                                          .vertexOffset =
+                                              meshes[m].vertexOffset,
+                                          .firstInstance = 0},
+                              .transformOffset = first,
+                              .meshIndex = m};
+            i += run;
+        }
+    }
+    return count;
+}
+
+// count instances of meshes within radius of their origin on a square grid in
+// the y = 0 plane, centered on the origin and spaced to not overlap, each
+// rotated about y. Returns the radius of a sphere bounding all of them.
+float MakeInstanceGrid(vector<Transform>& transforms, uint32_t count,
+                       float radius) {
+    const uint32_t side = uint32_t(ceilf(sqrtf(float(count))));
+    const float spacing = 2.5f * radius;
+    const float origin = -0.5f * spacing * float(side - 1);
+    transforms.resize(count);
+    for (uint32_t i = 0; i != count; ++i) {
+        const float x = origin + spacing * float(i % side);
+        const float z = origin + spacing * float(i / side);
+        const float angle = float(i) * 2.4f;
+        const float c = cosf(angle);
+        const float s = sinf(angle);
+        transforms[i] = {{{c, 0, s, x}, {0, 1, 0, 0}, {-s, 0, c, z}}};
+    }
+    return count > 1 ? -origin * sqrtf(2.0f) + radius : radius;
+}
+
+// Distance from the camera, distance units in front of the world origin, to
+// the origin of an instance in mesh units: a scaled instance looks like the
+// mesh at distance / scale
+float InstanceDistance(const Transform& t, float cameraDistance) {
+    const float x = t.rows[0][3];
+    const float y = t.rows[1][3];
+    const float z = t.rows[2][3] + cameraDistance;
+    const float scale = sqrtf(t.rows[0][0] * t.rows[0][0] +
+                              t.rows[1][0] * t.rows[1][0] +
+                              t.rows[2][0] * t.rows[2][0]);
+    return sqrtf(x * x + y * y + z * z) / scale;
+}
+
+enum CullFlags {
+    CULL_CONE = 1,
+    // test against the depth pyramid; without CULL_LATE only meshlets
+    // visible in the previous frame pass
+    CULL_OCCLUSION = 2,
+    CULL_LATE = 4
+};
+
+// Push constants of the meshlet culling shader: the camera, the side planes of
+// its view frustum and the instances of a scene mesh, dispatched once per
+// instance along y. Commands are written from drawOffset on and counted in
+// draw count 0, or 1 with CULL_LATE.
+struct CullData {
+    Camera camera;
+    // normalized x, z of the left/right planes and y, z of the top/bottom ones,
+    // mirrored about the view axis
+    float frustum[4];
+    uint32_t flags;
+    uint32_t drawOffset;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+    uint32_t meshIndex;
+};
+
+// The instances of mesh, meshes[meshIndex], are [firstInstance,
+// firstInstance + instances)
+CullData MakeCullData(const Camera& camera, const SceneMesh& mesh,
+                      uint32_t meshIndex, uint32_t firstInstance,
+                      uint32_t flags, uint32_t drawOffset) {
+    // the plane x * P00 = z, i.e. (-P00, 0, 1) normalized, and likewise for y
+    const float lx = sqrtf(camera.P00 * camera.P00 + 1);
+    const float ly = sqrtf(camera.P11 * camera.P11 + 1);
+    CullData data = {.camera = camera,
+                     .frustum = {camera.P00 / lx, 1 / lx, camera.P11 / ly,
+                                 1 / ly},
+                     .flags = flags,
+                     .drawOffset = drawOffset,
+                     .vertexOffset = mesh.vertexOffset,
+                     .firstInstance = firstInstance,
+                     .meshIndex = meshIndex};
+    return data;
+}
+
+// Meshlets of the level an instance draws and its visibility flag of the
+// first one, read by the culling shader at the instance index
+struct InstanceLod {
+    uint32_t meshletOffset;
+    uint32_t meshletCount;
+    uint32_t visibilityOffset;
+};
+
+// First visibility flag of instance of mesh: every mesh has instances *
+// meshletCount flags, one per meshlet of each level, after those of the
+// meshes before it
+uint32_t VisibilityOffset(const SceneMesh& mesh, uint32_t instances,
+                          uint32_t instance) {
+    return mesh.meshletOffset * instances + instance * mesh.meshletCount;
+}
+
+// Maps path and points view into it; fails on a version or source mismatch
+bool LoadMeshCache(MappedFile& file, MeshView& view, const string& path,
+                   const MeshCacheKey& key) {
+    if (!MapFile(file, path)) return false;
+    MeshCacheHeader header;
+    bool valid = file.size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, file.data, sizeof(header));
+        float lodRatios[MAX_LODS - 1];
+        CacheLodRatios(key, lodRatios);
+        valid = header.magic == MESH_CACHE_MAGIC &&
+                header.version == MESH_CACHE_VERSION &&
+                header.vertexSize == VertexSize(key.vertexFormat) &&
+                header.indexSize == sizeof(uint32_t) &&
+                header.optimizations == key.optimizations &&
+                header.vertexFormat == key.vertexFormat &&
+                header.sourceSize == key.sourceSize &&
+                header.sourceHash == key.sourceHash &&
+                memcmp(header.lodRatios, lodRatios, sizeof(lodRatios)) == 0 &&
+                header.lodCount > 0 && header.lodCount <= MAX_LODS &&
+                file.size ==
+                    sizeof(header) + header.lodCount * sizeof(MeshLod) +
+                        header.meshletCount * sizeof(Meshlet) +
+                        header.vertexCount * header.vertexSize +
+                        header.indexCount * sizeof(uint32_t) * 2 +
+                        header.meshletVertexCount * sizeof(uint32_t) +
+                        header.vertexCount * PositionSize(key.vertexFormat) +
+                        header.meshletTriangleBytes;
+    }
+    if (!valid) {
+        cerr << "Ignoring stale mesh cache " << path << endl;
+        UnmapFile(file);
+        return false;
+    }
+    const char* data = static_cast<const char*>(file.data) + sizeof(header);
+    view.lods = reinterpret_cast<const MeshLod*>(data);
+    view.lodCount = header.lodCount;
+    data += header.lodCount * sizeof(MeshLod);
+    view.meshlets = reinterpret_cast<const Meshlet*>(data);
+    view.meshletCount = size_t(header.meshletCount);
+    data += header.meshletCount * sizeof(Meshlet);
+    view.vertexFormat = key.vertexFormat;
+    view.vertices = data;
+    view.vertexCount = size_t(header.vertexCount);
+    data += header.vertexCount * header.vertexSize;
+    view.indices = reinterpret_cast<const uint32_t*>(data);
+    view.indexCount = size_t(header.indexCount);
+    data += header.indexCount * sizeof(uint32_t);
+    view.shadowIndices = reinterpret_cast<const uint32_t*>(data);
+    data += header.indexCount * sizeof(uint32_t);
+    view.meshletVertices = reinterpret_cast<const uint32_t*>(data);
+    view.meshletVertexCount = size_t(header.meshletVertexCount);
+    data += header.meshletVertexCount * sizeof(uint32_t);
+    view.positions = data;
+    data += header.vertexCount * PositionSize(key.vertexFormat);
+    view.meshletTriangles = reinterpret_cast<const uint8_t*>(data);
+    view.meshletTriangleBytes = size_t(header.meshletTriangleBytes);
+    memcpy(view.boundsMin, header.boundsMin, sizeof(view.boundsMin));
+    memcpy(view.boundsMax, header.boundsMax, sizeof(view.boundsMax));
+    return true;
+}
+
+// Same temporary file and rename scheme as SavePipelineCache
+void SaveMeshCache(const string& path, const MeshView& view,
+                   const MeshCacheKey& key) {
+    MeshCacheHeader header = {.magic = MESH_CACHE_MAGIC,
+                              .version = MESH_CACHE_VERSION,
+                              .vertexSize = VertexSize(key.vertexFormat),
+                              .indexSize = sizeof(uint32_t),
+                              .optimizations = key.optimizations,
+                              .vertexFormat = key.vertexFormat,
+                              .sourceSize = key.sourceSize,
+                              .sourceHash = key.sourceHash,
+                              .vertexCount = view.vertexCount,
+                              .indexCount = view.indexCount,
+                              .lodCount = uint32_t(view.lodCount),
+                              .meshletCount = view.meshletCount,
+                              .meshletVertexCount = view.meshletVertexCount,
+                              .meshletTriangleBytes =
+                                  view.meshletTriangleBytes};
+    CacheLodRatios(key, header.lodRatios);
+    memcpy(header.boundsMin, view.boundsMin, sizeof(header.boundsMin));
+    memcpy(header.boundsMax, view.boundsMax, sizeof(header.boundsMax));
+    string tmpPath = path + ".XXXXXX";
+    const int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0) {
+        perror("mkstemp() error");
+        return;
+    }
+    // mkstemp creates the file 0600 and rename keeps the mode
+    const mode_t mask = umask(0);
+    umask(mask);
+    if (fchmod(fd, 0644 & ~mask) != 0) perror("fchmod() error");
+    FILE* file = fdopen(fd, "wb");
+    if (!file) {
+        perror("fdopen() error");
+        close(fd);
+        remove(tmpPath.c_str());
+        return;
+    }
+    const size_t vertexBytes = view.vertexCount * header.vertexSize;
+    const size_t indexBytes = view.indexCount * sizeof(uint32_t);
+    const size_t meshletVertexBytes =
+        view.meshletVertexCount * sizeof(uint32_t);
+    const size_t positionBytes =
+        view.vertexCount * PositionSize(key.vertexFormat);
+    const bool written =
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(view.lods, sizeof(MeshLod), view.lodCount, file) ==
+            view.lodCount &&
+        fwrite(view.meshlets, sizeof(Meshlet), view.meshletCount, file) ==
+            view.meshletCount &&
+        fwrite(view.vertices, 1, vertexBytes, file) == vertexBytes &&
+        fwrite(view.indices, 1, indexBytes, file) == indexBytes &&
+        fwrite(view.shadowIndices, 1, indexBytes, file) == indexBytes &&
+        fwrite(view.meshletVertices, 1, meshletVertexBytes, file) ==
+            meshletVertexBytes &&
+        fwrite(view.positions, 1, positionBytes, file) == positionBytes &&
+        fwrite(view.meshletTriangles, 1, view.meshletTriangleBytes, file) ==
+            view.meshletTriangleBytes &&
+        fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0 || !written ||
+        rename(tmpPath.c_str(), path.c_str()) != 0) {
+        perror("Cannot write mesh cache");
+        remove(tmpPath.c_str());
+    }
+}
+
+// Cache file for path, in a meshcache directory next to the executable.
+// Named after the file and a hash of its canonical path, so that files of
+// the same name in different directories get their own entries.
+string MeshCachePath(const string& path) {
+    const string dir = ExecutableDir() + "meshcache/";
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        perror("mkdir() error");
+    }
+    char* canonical = realpath(path.c_str(), nullptr);
+    const string key = canonical ? canonical : path;
+    free(canonical);
+    const uLong crc = crc32(crc32(0, Z_NULL, 0),
+                            reinterpret_cast<const Bytef*>(key.data()),
+                            uInt(key.size()));
+    char hash[16];
+    snprintf(hash, sizeof(hash), ".%08lx", crc);
+    return dir + path.substr(path.find_last_of('/') + 1) + hash + ".mesh";
+}
+
+// Returns a view of the cached mesh when the cache matches the source,
+// otherwise parses the source into mesh and refreshes the cache.
+// cacheFile must stay mapped until the view is no longer used.
+bool LoadMeshCached(MeshView& view, Mesh& mesh, MappedFile& cacheFile,
+                    const string& path, unsigned threads, ObjLoader loader,
+                    uint32_t optimizations, VertexFormat vertexFormat,
+                    const vector<float>& lodRatios, bool useCache) {
+    MeshCacheKey key = {.optimizations = optimizations,
+                        .vertexFormat = vertexFormat,
+                        .lodRatios = lodRatios};
+    if (!HashFile(path, key.sourceSize, key.sourceHash)) {
+        cerr << "Cannot read " << path << endl;
+        return false;
+    }
+    const string cachePath = MeshCachePath(path);
+    const double start = glfwGetTime();
+    if (useCache && LoadMeshCache(cacheFile, view, cachePath, key)) {
+        cout << "Mapped mesh cache " << cachePath << " in "
+             << (glfwGetTime() - start) * 1000 << " ms" << endl;
+        return true;
+    }
+    if (!LoadMesh(mesh, path.c_str(), threads, loader)) {
+        cerr << "No vertices in " << path << endl;
+        return false;
+    }
+    OptimizeMesh(mesh, optimizations);
+    if (!lodRatios.empty()) {
+        GenerateLods(mesh, lodRatios, optimizations & OPTIMIZE_VERTEX_CACHE);
+    }
+    if (optimizations & OPTIMIZE_VERTEX_FETCH) OptimizeVertexFetch(mesh);
+    BuildMeshlets(mesh);
+    GenerateShadowIndices(mesh);
+    view = MakeMeshView(mesh, vertexFormat);
+    if (useCache) SaveMeshCache(cachePath, view, key);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Device memory is reserved in large blocks per memory type and handed out
+// with a buddy allocator: every allocation is a power of two sized, naturally
+// aligned range inside a block, so any alignment up to the allocation size
+// comes for free and freed ranges merge back with their buddies. Requests
+// larger than a block get a dedicated vkAllocateMemory.
+struct MemoryBlock {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    void* data;  // persistently mapped base, null if not host visible
+    // free offsets, indexed by order - MIN_ORDER; empty for dedicated blocks
+    vector<set<VkDeviceSize>> freeLists;
+    VkDeviceSize used;
+};
+
+struct Allocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    void* data;
+    uint32_t memoryType;
+    uint32_t block;
+    uint32_t order;
+};
+
+struct Allocator {
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties memProps;
+    VkDeviceSize blockSize;
+    vector<MemoryBlock> blocks[VK_MAX_MEMORY_TYPES];
+    uint32_t deviceAllocations;  // live vkAllocateMemory allocations
+};
+
+// 256 byte minimum allocation, covers the usual buffer alignments
+constexpr uint32_t MIN_ORDER = 8;
+
+uint32_t Log2Ceil(VkDeviceSize size) {
+    uint32_t order = 0;
+    while ((VkDeviceSize(1) << order) < size) ++order;
+    return order;
+}
+
+void CreateAllocator(Allocator& result, VkDevice device,
+                     const VkPhysicalDeviceMemoryProperties& memProps,
+                     VkDeviceSize blockSize = 64 * 1024 * 1024) {
+    result.device = device;
+    result.memProps = memProps;
+    result.blockSize = VkDeviceSize(1) << Log2Ceil(blockSize);
+    result.deviceAllocations = 0;
+}
+
+MemoryBlock& AddBlock(Allocator& allocator, uint32_t memoryType,
+                      VkDeviceSize size, bool dedicated, uint32_t& index) {
+    VkMemoryAllocateInfo allocateInfo = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = size,
+        .memoryTypeIndex = memoryType};
+    MemoryBlock block = {.size = size, .data = nullptr, .used = 0};
+    VK_CHECK(vkAllocateMemory(allocator.device, &allocateInfo, nullptr,
+                              &block.memory));
+    ++allocator.deviceAllocations;
+    if (allocator.memProps.memoryTypes[memoryType].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        VK_CHECK(vkMapMemory(allocator.device, block.memory, 0, VK_WHOLE_SIZE,
+                             0, &block.data));
+    }
+    if (!dedicated) {
+        const uint32_t order = Log2Ceil(size);
+        block.freeLists.resize(order - MIN_ORDER + 1);
+        block.freeLists.back().insert(0);
+    }
+    // reuse the slot of a released dedicated block to keep indices stable
+    vector<MemoryBlock>& blocks = allocator.blocks[memoryType];
+    for (index = 0; index != blocks.size(); ++index) {
+        if (blocks[index].memory == VK_NULL_HANDLE) break;
+    }
+    if (index == blocks.size()) blocks.push_back({});
+    blocks[index] = move(block);
+    return blocks[index];
+}
+
+// Returns false when no free range of the requested order exists
+bool BuddyAllocate(MemoryBlock& block, uint32_t order, VkDeviceSize& offset) {
+    const uint32_t level = order - MIN_ORDER;
+    uint32_t l = level;
+    while (l < block.freeLists.size() && block.freeLists[l].empty()) ++l;
+    if (l >= block.freeLists.size()) return false;
+    offset = *block.freeLists[l].begin();
+    block.freeLists[l].erase(block.freeLists[l].begin());
+    // split, keeping the lower half and releasing the upper one
+    while (l > level) {
+        --l;
+        const VkDeviceSize half = VkDeviceSize(1) << (l + MIN_ORDER);
+        block.freeLists[l].insert(offset + half);
+    }
+    return true;
+}
+
+void BuddyFree(MemoryBlock& block, uint32_t order, VkDeviceSize offset) {
+    uint32_t l = order - MIN_ORDER;
+    while (l + 1 < block.freeLists.size()) {
+        const VkDeviceSize buddy =
+            offset ^ (VkDeviceSize(1) << (l + MIN_ORDER));
+        auto it = block.freeLists[l].find(buddy);
+        if (it == block.freeLists[l].end()) break;
+        block.freeLists[l].erase(it);
+        offset = min(offset, buddy);
+        ++l;
+    }
+    block.freeLists[l].insert(offset);
+}
+
+Allocation Allocate(Allocator& allocator,
+                    const VkMemoryRequirements& requirements,
+                    VkMemoryPropertyFlags flags) {
+    const uint32_t memoryType = SelectMemoryType(
+        allocator.memProps, requirements.memoryTypeBits, flags);
+    assert(memoryType != ~0u);
+    const uint32_t order =
+        max(Log2Ceil(max(requirements.size, requirements.alignment)),
+            MIN_ORDER);
+
+    Allocation result = {.memoryType = memoryType, .order = order};
+    vector<MemoryBlock>& blocks = allocator.blocks[memoryType];
+    if ((VkDeviceSize(1) << order) > allocator.blockSize) {
+        MemoryBlock& block = AddBlock(allocator, memoryType, requirements.size,
+                                      true, result.block);
+        block.used = requirements.size;
+        result.memory = block.memory;
+        result.offset = 0;
+        result.data = block.data;
+        return result;
+    }
+    result.block = ~0u;
+    for (uint32_t i = 0; i != blocks.size(); ++i) {
+        // skips dedicated and released blocks, which have no free lists
+        if (blocks[i].freeLists.empty()) continue;
+        if (BuddyAllocate(blocks[i], order, result.offset)) {
+            result.block = i;
+            break;
+        }
+    }
+    if (result.block == ~0u) {
+        MemoryBlock& block = AddBlock(allocator, memoryType,
+                                      allocator.blockSize, false, result.block);
+        const bool rc = BuddyAllocate(block, order, result.offset);
+        assert(rc);
+    }
+    MemoryBlock& block = blocks[result.block];
+    block.used += VkDeviceSize(1) << order;
+    result.memory = block.memory;
+    result.data =
+        block.data ? static_cast<char*>(block.data) + result.offset : nullptr;
+    return result;
+}
+
+// Blocks are kept when they become empty and reused by later allocations;
+// dedicated allocations are released immediately
+void Free(Allocator& allocator, const Allocation& allocation) {
+    MemoryBlock& block =
+        allocator.blocks[allocation.memoryType][allocation.block];
+    assert(block.memory == allocation.memory);
+    if (block.freeLists.empty()) {
+        vkFreeMemory(allocator.device, block.memory, nullptr);
+        --allocator.deviceAllocations;
+        block = {};
+        return;
+    }
+    BuddyFree(block, allocation.order, allocation.offset);
+    block.used -= VkDeviceSize(1) << allocation.order;
+}
+
+void DestroyAllocator(Allocator& allocator) {
+    for (vector<MemoryBlock>& blocks : allocator.blocks) {
+        for (MemoryBlock& block : blocks) {
+            if (block.memory == VK_NULL_HANDLE) continue;
+            assert(block.used == 0);
+            vkFreeMemory(allocator.device, block.memory, nullptr);
+        }
+        blocks.clear();
+    }
+    allocator.deviceAllocations = 0;
+}
+
+// vkAllocateMemory calls against the bytes handed out to buffers
+void PrintAllocatorStats(const Allocator& allocator) {
+    VkDeviceSize reserved = 0;
+    VkDeviceSize used = 0;
+    for (const vector<MemoryBlock>& blocks : allocator.blocks) {
+        for (const MemoryBlock& block : blocks) {
+            if (block.memory == VK_NULL_HANDLE) continue;
+            reserved += block.size;
+            used += block.used;
+        }
+    }
+    cout << "Device memory: " << allocator.deviceAllocations
+         << " allocations, " << reserved / 1024 << " KB reserved, "
+         << used / 1024 << " KB used" << endl;
+}
+
+//------------------------------------------------------------------------------
 struct Buffer {
     VkBuffer buffer;
-    VkDeviceMemory memory;
+    Allocation allocation;
     void* data;
     size_t size;
 };
 
-void CreateBuffer(Buffer& result, VkDevice device,
-                  VkPhysicalDeviceMemoryProperties memProps, size_t size,
-                  VkBufferUsageFlags usage) {
+// The buffer is persistently mapped when memoryFlags includes HOST_VISIBLE
+void CreateBuffer(Buffer& result, Allocator& allocator, size_t size,
+                  VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryFlags) {
+    VkDevice device = allocator.device;
     VkBufferCreateInfo createInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
                                      .size = size, .usage = usage};
     VkBuffer buffer = VK_NULL_HANDLE;
@@ -729,40 +2792,700 @@ void CreateBuffer(Buffer& result, VkDevice device,
 
     VkMemoryRequirements memoryRequirements;
     vkGetBufferMemoryRequirements(device, buffer, &memoryRequirements);
-    uint32_t memoryTypeIndex =
-        SelectMemoryType(memProps, memoryRequirements.memoryTypeBits,
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                             VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-    assert(memoryTypeIndex != ~0u);
+    const Allocation allocation =
+        Allocate(allocator, memoryRequirements, memoryFlags);
 
-    VkMemoryAllocateInfo allocateInfo = {
-        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .allocationSize = memoryRequirements.size,
-        memoryTypeIndex = memoryTypeIndex};
+    VK_CHECK(vkBindBufferMemory(device, buffer, allocation.memory,
+                                allocation.offset));
 
-    VkDeviceMemory memory = VK_NULL_HANDLE;
-    VK_CHECK(vkAllocateMemory(device, &allocateInfo, nullptr, &memory));
+    result.buffer = buffer;
+    result.allocation = allocation;
+    result.data = (memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+                      ? allocation.data
+                      : nullptr;
+    result.size = size;
+}
 
-    VK_CHECK(vkBindBufferMemory(device, buffer, memory, 0));
+void DestroyBuffer(Buffer& buffer, Allocator& allocator) {
+    vkDestroyBuffer(allocator.device, buffer.buffer, nullptr);
+    Free(allocator, buffer.allocation);
+}
 
-    void* data = nullptr;
-    VK_CHECK(vkMapMemory(device, memory, 0, size, 0, &data));
+// Per frame in flight output of the culling passes, MeshDraw commands of the
+// early draws followed by late ones; the visible meshlet counts are copied to
+// host memory and read back once the frame's fence signals
+struct CullTarget {
+    Buffer commands;
+    Buffer count;
+    Buffer readback;
+    // InstanceLod of every instance, written by the CPU
+    Buffer lods;
+};
 
-    result.buffer = buffer;
-    result.memory = memory;
-    result.data = data;
-    result.size = size;
+//------------------------------------------------------------------------------
+// UMA or resizable BAR: device local memory the CPU can map, on a heap larger
+// than the legacy 256 MB BAR window. The GPU then reads the meshes from where
+// the CPU wrote them and no staging copy is needed
+bool DeviceLocalHostVisible(const VkPhysicalDeviceMemoryProperties& memProps) {
+    const VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    const VkDeviceSize BAR_SIZE = 256 * 1024 * 1024;
+    for (uint32_t i = 0; i != memProps.memoryTypeCount; ++i) {
+        const VkMemoryType& type = memProps.memoryTypes[i];
+        if ((type.propertyFlags & flags) == flags &&
+            memProps.memoryHeaps[type.heapIndex].size > BAR_SIZE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copies size bytes of staging to a device local buffer and waits for the
+// copy to complete
+void CopyBuffer(VkDevice device, VkCommandPool commandPool, VkQueue queue,
+                const Buffer& staging, const Buffer& buffer, size_t size) {
+    assert(staging.size >= size);
+    assert(buffer.size >= size);
+
+    VkCommandBufferAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1};
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    VK_CHECK(vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer));
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT};
+    VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+    VkBufferCopy region = {.srcOffset = 0, .dstOffset = 0, .size = size};
+    vkCmdCopyBuffer(commandBuffer, staging.buffer, buffer.buffer, 1, &region);
+
+    // make the copy visible to vertex pulling, index fetch and culling in
+    // later submissions
+    VkBufferMemoryBarrier copyBarrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDEX_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = buffer.buffer,
+        .offset = 0,
+        .size = size};
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                             VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, nullptr, 1, &copyBarrier, 0, nullptr);
+    VK_CHECK(vkEndCommandBuffer(commandBuffer));
+
+    VkFence fence = CreateFence(device);
+    VkSubmitInfo submitInfo = {.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                               .commandBufferCount = 1,
+                               .pCommandBuffers = &commandBuffer};
+    VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fence));
+    VK_CHECK(vkWaitForFences(device, 1, &fence, VK_TRUE, ~uint64_t(0)));
+    vkDestroyFence(device, fence, nullptr);
+    vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+}
+
+// Fills a device local buffer through a host visible staging buffer
+void UploadBuffer(VkDevice device, VkCommandPool commandPool, VkQueue queue,
+                  const Buffer& staging, const Buffer& buffer, const void* data,
+                  size_t size) {
+    assert(staging.data);
+    memcpy(staging.data, data, size);
+    CopyBuffer(device, commandPool, queue, staging, buffer, size);
+}
+
+//------------------------------------------------------------------------------
+// Direct loading: the mesh lives in tinyobj's attribute arrays and in GPU
+// visible memory only, without Mesh, cache or scene arenas in between
+
+// State of the LoadObjWithCallback callbacks of LoadMeshDirect
+struct DirectLoad {
+    vector<float> positions;
+    vector<float> normals;
+    vector<float> texCoords;
+    // one output vertex per distinct (position, normal, uv) index triple
+    unordered_map<ObjIndex, uint32_t, ObjIndexHash> remap;
+    // the output vertices in first use order, copied to the vertex buffer in
+    // one sequential pass rather than scattered over write-combined memory
+    vector<Vertex> vertices;
+    uint32_t* indices = nullptr;
+    size_t indexCount = 0;
+    size_t maxIndices = 0;
+    // output vertex of each corner of the current face
+    vector<uint32_t> corners;
+    // faces of less than 3 vertices, dropped like the pre-scan does
+    size_t droppedFaces = 0;
+    bool normal = false;
+    bool texCoord = false;
+    bool valid = true;
+};
+
+// OBJ index: 1 based, negative relative to the count so far, 0 when absent
+int ResolveObjIndex(int index, size_t count) {
+    return index > 0 ? index - 1 : index < 0 ? int(count) + index : -1;
 }
 
-void DestroyBuffer(Buffer& buffer, VkDevice device) {
-    vkFreeMemory(device, buffer.memory, nullptr);
-    vkDestroyBuffer(device, buffer.buffer, nullptr);
+// Deduplicates the corners of a face and appends its fan triangles to the
+// mapped indices
+void DirectFace(void* userData, tinyobj::index_t* face, int count) {
+    DirectLoad& load = *static_cast<DirectLoad*>(userData);
+    // as counted by the pre-scan
+    if (count < 3) {
+        ++load.droppedFaces;
+        return;
+    }
+    if (load.indexCount + 3 * size_t(count - 2) > load.maxIndices) {
+        load.valid = false;
+        return;
+    }
+    vector<uint32_t>& corners = load.corners;
+    corners.resize(size_t(count));
+    for (int i = 0; i != count; ++i) {
+        const ObjIndex key = {
+            ResolveObjIndex(face[i].vertex_index, load.positions.size() / 3),
+            ResolveObjIndex(face[i].normal_index, load.normals.size() / 3),
+            ResolveObjIndex(face[i].texcoord_index, load.texCoords.size() / 2)};
+        if (key.position < 0 ||
+            size_t(key.position) >= load.positions.size() / 3 ||
+            size_t(key.normal + 1) > load.normals.size() / 3 ||
+            size_t(key.texCoord + 1) > load.texCoords.size() / 2) {
+            load.valid = false;
+            return;
+        }
+        load.normal = load.normal || key.normal >= 0;
+        load.texCoord = load.texCoord || key.texCoord >= 0;
+        const auto inserted =
+            load.remap.insert({key, uint32_t(load.vertices.size())});
+        corners[i] = inserted.first->second;
+        if (!inserted.second) continue;
+        const float* p = &load.positions[3 * key.position];
+        const float* n =
+            key.normal >= 0 ? &load.normals[3 * key.normal] : nullptr;
+        const float* t =
+            key.texCoord >= 0 ? &load.texCoords[2 * key.texCoord] : nullptr;
+        load.vertices.push_back({.vx = p[0],
+                                 .vy = p[1],
+                                 .vz = p[2],
+                                 .nx = n ? n[0] : 0,
+                                 .ny = n ? n[1] : 0,
+                                 .nz = n ? n[2] : 0,
+                                 .tu = t ? t[0] : 0,
+                                 .tv = t ? t[1] : 0});
+    }
+    uint32_t* indices = load.indices + load.indexCount;
+    for (int i = 2; i != count; ++i) {
+        *indices++ = corners[0];
+        *indices++ = corners[i - 1];
+        *indices++ = corners[i];
+    }
+    load.indexCount += 3 * size_t(count - 2);
+}
+
+// Parses a single mesh into vb and ib: a pre-scan sizes the index buffer, the
+// deduplicated indices are written while parsing and the vertices once they
+// are all known. Gzip sources are inflated twice, for the pre-scan and while
+// parsing. Without host visible device memory both go through staging
+// buffers. Fills the mesh and bounds of scene but none of its arenas.
+void LoadMeshDirect(Scene& scene, Buffer& vb, Buffer& ib, const string& path,
+                    Allocator& allocator, bool directUpload, VkQueue queue,
+                    uint32_t queueFamily) {
+    const double start = glfwGetTime();
+    const bool gz = EndsWith(path, ".gz");
+    MappedFile file;
+    tinyobj::obj_counts_t counts;
+    if (gz ? !CountGzObj(counts, path.c_str())
+           : !MapFile(file, path.c_str())) {
+        cerr << "Cannot read " << path << endl;
+        exit(1);
+    }
+    if (!gz) {
+        tinyobj::CountObj(&counts, static_cast<const char*>(file.data),
+                          file.size);
+    }
+
+    const VkMemoryPropertyFlags hostMemory =
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    const VkMemoryPropertyFlags memory =
+        directUpload ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | hostMemory
+                     : hostMemory;
+    const VkBufferUsageFlags vertexUsage =
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    const VkBufferUsageFlags indexUsage =
+        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    const VkBufferUsageFlags stagingUsage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    Buffer indices = {};
+    Buffer vertices = {};
+    CreateBuffer(indices, allocator,
+                 sizeof(uint32_t) * max(counts.num_indices, size_t(1)),
+                 directUpload ? indexUsage : stagingUsage, memory);
+
+    DirectLoad load;
+    load.positions.reserve(3 * counts.num_vertices);
+    load.normals.reserve(3 * counts.num_normals);
+    load.texCoords.reserve(2 * counts.num_texcoords);
+    load.remap.reserve(counts.num_vertices);
+    load.vertices.reserve(counts.num_vertices);
+    load.indices = static_cast<uint32_t*>(indices.data);
+    load.maxIndices = counts.num_indices;
+    tinyobj::callback_t callback;
+    callback.vertex_cb = [](void* userData, tinyobj::real_t x,
+                            tinyobj::real_t y, tinyobj::real_t z,
+                            tinyobj::real_t) {
+        DirectLoad& load = *static_cast<DirectLoad*>(userData);
+        load.positions.insert(load.positions.end(), {x, y, z});
+    };
+    callback.normal_cb = [](void* userData, tinyobj::real_t x,
+                            tinyobj::real_t y, tinyobj::real_t z) {
+        DirectLoad& load = *static_cast<DirectLoad*>(userData);
+        load.normals.insert(load.normals.end(), {x, y, z});
+    };
+    callback.texcoord_cb = [](void* userData, tinyobj::real_t x,
+                              tinyobj::real_t y, tinyobj::real_t) {
+        DirectLoad& load = *static_cast<DirectLoad*>(userData);
+        load.texCoords.insert(load.texCoords.end(), {x, y});
+    };
+    callback.index_cb = DirectFace;
+    unique_ptr<std::streambuf> buf;
+    if (gz) {
+        buf.reset(new GzStreamBuf(path.c_str()));
+    } else {
+        buf.reset(new MemoryStreamBuf(file.data, file.size));
+    }
+    std::istream stream(buf.get());
+    std::string warn, err;
+    bool ok = tinyobj::LoadObjWithCallback(stream, callback, &load, nullptr,
+                                           &warn, &err);
+    if (gz) ok = ok && !static_cast<GzStreamBuf&>(*buf).Error();
+    buf.reset();
+    UnmapFile(file);
+    if (!warn.empty()) std::cout << "LoadObjWithCallback: " << warn;
+    if (!err.empty()) std::cerr << "LoadObjWithCallback: " << err;
+    if (!ok || !load.valid || load.remap.empty()) {
+        cerr << "Cannot load " << path << endl;
+        exit(1);
+    }
+    if (load.droppedFaces) {
+        cerr << "Dropped " << load.droppedFaces
+             << " faces of less than 3 vertices" << endl;
+    }
+
+    const size_t vertexBytes = sizeof(Vertex) * load.vertices.size();
+    CreateBuffer(vertices, allocator, vertexBytes,
+                 directUpload ? vertexUsage : stagingUsage, memory);
+    memcpy(vertices.data, load.vertices.data(), vertexBytes);
+    float boundsMin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float boundsMax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (const Vertex& v : load.vertices) {
+        const float p[3] = {v.vx, v.vy, v.vz};
+        for (int i = 0; i != 3; ++i) {
+            boundsMin[i] = min(boundsMin[i], p[i]);
+            boundsMax[i] = max(boundsMax[i], p[i]);
+        }
+    }
+    float radius = 0;
+    for (int i = 0; i != 3; ++i) {
+        const float e = max(fabsf(boundsMin[i]), fabsf(boundsMax[i]));
+        radius += e * e;
+    }
+    scene.radius = sqrtf(radius);
+    scene.vertexFormat = VERTEX_FORMAT_FLOAT;
+    const uint32_t indexCount = uint32_t(load.indexCount);
+    scene.meshes = {{.firstIndex = 0,
+                     .indexCount = indexCount,
+                     .vertexOffset = 0,
+                     .meshletOffset = 0,
+                     .meshletCount = 0,
+                     .lods = {{0, indexCount, 0, 0, 0}},
+                     .quantization = MakeQuantization(boundsMin, boundsMax)}};
+    cout << "Loaded " << path << " directly in "
+         << (glfwGetTime() - start) * 1000 << " ms: " << load.vertices.size()
+         << " vertices, " << indexCount << " indices" << endl;
+    load = DirectLoad();
+
+    if (directUpload) {
+        vb = vertices;
+        ib = indices;
+        return;
+    }
+    VkCommandPool pool = CreateCommandPool(allocator.device, queueFamily);
+    const VkBufferUsageFlags dst = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    CreateBuffer(vb, allocator, vertices.size, vertexUsage | dst,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    CreateBuffer(ib, allocator, indices.size, indexUsage | dst,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    CopyBuffer(allocator.device, pool, queue, vertices, vb, vertices.size);
+    CopyBuffer(allocator.device, pool, queue, indices, ib, indices.size);
+    vkDestroyCommandPool(allocator.device, pool, nullptr);
+    DestroyBuffer(vertices, allocator);
+    DestroyBuffer(indices, allocator);
+}
+
+//==============================================================================
+//------------------------------------------------------------------------------
+struct Options {
+    uint32_t framesInFlight = 2;
+    // redraw as fast as the present mode allows instead of waiting for input
+    bool continuous = false;
+    VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+    uint32_t imageCount = 2;
+    // use the staging path even when device local memory is host visible
+    bool forceStaging = false;
+    string meshPath = "../../../assets/kitten.obj.gz";
+    // directory or manifest of meshes drawn together, replaces meshPath
+    string scenePath;
+    ObjLoader objLoader = OBJ_LOADER_TINYOBJ;
+    // > 1 selects the parallel tinyobj parser
+    unsigned loadThreads = 1;
+    // time the parser at increasing thread counts on every mesh and exit
+    bool loadScaling = false;
+    // compare the obj loaders on every mesh of a directory and exit
+    string loadBenchmarkDir;
+    // map a binary copy of the parsed mesh instead of parsing every run
+    bool meshCache = true;
+    // MeshOptimization stages run after loading
+    uint32_t optimizations = OPTIMIZE_ALL;
+    VertexFormat vertexFormat = VERTEX_FORMAT_FLOAT;
+    // triangle count of each coarser level relative to the full mesh
+    vector<float> lodRatios = {0.5f, 0.25f, 0.125f, 0.0625f};
+    // camera distance from the mesh and allowed error in pixels
+    float lodDistance = 1;
+    float lodThreshold = 1;
+    // cull meshlets in a compute pass and draw the survivors indirectly
+    bool gpuCulling = true;
+    // also reject meshlets whose triangles all face away from the viewer;
+    // the pipeline draws back faces, so this is opt in, for closed meshes
+    bool coneCulling = false;
+    // and meshlets hidden behind the depth of the previously visible ones
+    bool occlusionCulling = true;
+    // lay down depth from the position stream before shading
+    bool depthPrepass = false;
+    // without GPU culling, draw all meshes with one indirect draw of commands
+    // built on the CPU instead of one draw call each
+    bool multiDraw = false;
+    // copies of each mesh drawn on a grid with a single instanced draw
+    uint32_t instances = 1;
+    // parse the mesh straight into mapped buffer memory: one mesh with float
+    // vertices and no cache, optimizations, levels of detail or meshlets
+    bool directLoad = false;
+};
+
+// Comma separated list of ratios in (0, 1), "none" for no levels of detail
+vector<float> ParseLodRatios(const string& list) {
+    vector<float> ratios;
+    if (list == "none") return ratios;
+    size_t begin = 0;
+    while (begin < list.size() && ratios.size() < MAX_LODS - 1) {
+        const float ratio = strtof(list.c_str() + begin, nullptr);
+        if (ratio > 0 && ratio < 1) ratios.push_back(ratio);
+        const size_t end = list.find(',', begin);
+        if (end == string::npos) break;
+        begin = end + 1;
+    }
+    return ratios;
+}
+
+bool ParsePresentMode(const string& name, VkPresentModeKHR& mode) {
+    const VkPresentModeKHR modes[] = {
+        VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+        VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR};
+    for (VkPresentModeKHR m : modes) {
+        if (name == PresentModeString(m)) {
+            mode = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+Options ParseOptions(int argc, char const* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--frames-in-flight" && i + 1 < argc) {
+            options.framesInFlight = uint32_t(max(1, atoi(argv[++i])));
+        } else if (arg == "--continuous") {
+            options.continuous = true;
+        } else if (arg == "--present-mode" && i + 1 < argc) {
+            if (!ParsePresentMode(argv[++i], options.presentMode)) {
+                cerr << "Unknown present mode " << argv[i]
+                     << ", expected fifo|fifo_relaxed|mailbox|immediate"
+                     << endl;
+            }
+        } else if (arg == "--image-count" && i + 1 < argc) {
+            options.imageCount = uint32_t(max(1, atoi(argv[++i])));
+        } else if (arg == "--staging") {
+            options.forceStaging = true;
+        } else if (arg == "--mesh" && i + 1 < argc) {
+            options.meshPath = argv[++i];
+        } else if (arg == "--scene" && i + 1 < argc) {
+            options.scenePath = argv[++i];
+        } else if (arg == "--load-threads" && i + 1 < argc) {
+            options.loadThreads = unsigned(max(1, atoi(argv[++i])));
+        } else if (arg == "--load-scaling") {
+            options.loadScaling = true;
+        } else if (arg == "--load-benchmark" && i + 1 < argc) {
+            options.loadBenchmarkDir = argv[++i];
+        } else if (arg == "--obj-loader" && i + 1 < argc) {
+            const string loader = argv[++i];
+            if (loader == "tinyobj") {
+                options.objLoader = OBJ_LOADER_TINYOBJ;
+            } else if (loader == "fast_obj") {
+                options.objLoader = OBJ_LOADER_FAST_OBJ;
+            } else {
+                cerr << "Unknown obj loader " << loader
+                     << ", expected tinyobj|fast_obj" << endl;
+            }
+        } else if (arg == "--no-mesh-cache") {
+            options.meshCache = false;
+        } else if (arg == "--no-vertex-cache-opt") {
+            options.optimizations &= ~OPTIMIZE_VERTEX_CACHE;
+        } else if (arg == "--no-overdraw-opt") {
+            options.optimizations &= ~OPTIMIZE_OVERDRAW;
+        } else if (arg == "--no-vertex-fetch-opt") {
+            options.optimizations &= ~OPTIMIZE_VERTEX_FETCH;
+        } else if (arg == "--lod-ratios" && i + 1 < argc) {
+            options.lodRatios = ParseLodRatios(argv[++i]);
+        } else if (arg == "--lod-distance" && i + 1 < argc) {
+            options.lodDistance = float(atof(argv[++i]));
+        } else if (arg == "--lod-threshold" && i + 1 < argc) {
+            options.lodThreshold = float(atof(argv[++i]));
+        } else if (arg == "--no-gpu-culling") {
+            options.gpuCulling = false;
+        } else if (arg == "--cone-culling") {
+            options.coneCulling = true;
+        } else if (arg == "--no-occlusion-culling") {
+            options.occlusionCulling = false;
+        } else if (arg == "--depth-prepass") {
+            options.depthPrepass = true;
+        } else if (arg == "--multi-draw") {
+            options.multiDraw = true;
+        } else if (arg == "--instances" && i + 1 < argc) {
+            options.instances = uint32_t(max(1, atoi(argv[++i])));
+        } else if (arg == "--direct-load") {
+            options.directLoad = true;
+        } else if (arg == "--vertex-format" && i + 1 < argc) {
+            const string format = argv[++i];
+            if (format == "float") {
+                options.vertexFormat = VERTEX_FORMAT_FLOAT;
+            } else if (format == "quantized") {
+                options.vertexFormat = VERTEX_FORMAT_QUANTIZED;
+            } else {
+                cerr << "Unknown vertex format " << format
+                     << ", expected float|quantized" << endl;
+            }
+        } else {
+            cerr << "Unknown option " << arg << endl;
+        }
+    }
+    return options;
+}
+
+// Parse time of LoadObjParallel on 1..16 threads for every mesh of paths,
+// with its speedup over one thread and over the serial stream parser
+// LoadObj. The file is mapped, or inflated to memory, before any timing, so
+// every row parses the same bytes.
+void LoadScaling(const vector<string>& paths) {
+    const unsigned counts[] = {1, 2, 4, 8, 16};
+    for (const string& path : paths) {
+        const bool gz = EndsWith(path, ".gz");
+        MappedFile file;
+        vector<char> inflated;
+        if (gz) {
+            GzStreamBuf buf(path.c_str());
+            if (!InflateToMemory(buf, inflated)) exit(1);
+            file.data = inflated.data();
+            file.size = inflated.size();
+        } else if (!MapFile(file, path)) {
+            cerr << "Cannot map " << path << endl;
+            exit(1);
+        }
+        const char* data = static_cast<const char*>(file.data);
+        cout << path << ": " << file.size / 1024 << " KB" << endl;
+        cout << "loader\tthreads\tms\tspeedup\tvs LoadObj" << endl;
+
+        tinyobj::attrib_t attrib;
+        vector<tinyobj::shape_t> shapes;
+        vector<tinyobj::material_t> materials;
+        std::string warn, err;
+        MemoryStreamBuf buf(file.data, file.size);
+        std::istream stream(&buf);
+        double start = glfwGetTime();
+        if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
+                              &stream)) {
+            cerr << "LoadObj: " << err;
+            exit(1);
+        }
+        const double baseline = glfwGetTime() - start;
+        cout << "LoadObj\t1\t" << baseline * 1000 << "\t-\t1" << endl;
+
+        double serial = 0;
+        for (unsigned threads : counts) {
+            start = glfwGetTime();
+            if (!tinyobj::LoadObjParallel(&attrib, &shapes, &warn, &err, data,
+                                          file.size, threads)) {
+                cerr << "LoadObjParallel: " << err;
+                exit(1);
+            }
+            const double t = glfwGetTime() - start;
+            if (threads == 1) serial = t;
+            cout << "parallel\t" << threads << "\t" << t * 1000 << "\t"
+                 << serial / t << "\t" << baseline / t << endl;
+        }
+        if (!gz) UnmapFile(file);
+    }
+}
+
+// Resident set size in KB
+long ResidentKB() {
+    long pages = 0;
+    long resident = 0;
+    if (FILE* file = fopen("/proc/self/statm", "r")) {
+        if (fscanf(file, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(file);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Loads every mesh of dir with each obj loader and reports wall time, peak
+// resident memory above the resident memory before loading, and heap
+// allocations. Every load runs in a child process, so that its peak is its
+// own; gzip sources are inflated once beforehand, so that both loaders parse
+// the same plain file.
+void LoadBenchmark(const string& dir) {
+    const vector<string> paths = ScenePaths(dir);
+    const ObjLoader loaders[] = {OBJ_LOADER_TINYOBJ, OBJ_LOADER_FAST_OBJ};
+    cout << "mesh\tloader\tms\tpeak KB\tallocations" << endl;
+    for (const string& path : paths) {
+        char tmpPath[] = "/tmp/meshXXXXXX";
+        string objPath = path;
+        if (EndsWith(path, ".gz")) {
+            const int fd = mkstemp(tmpPath);
+            const bool ok = fd >= 0 && InflateToFile(path.c_str(), fd);
+            if (fd >= 0) close(fd);
+            if (!ok) {
+                cerr << "Cannot inflate " << path << endl;
+                if (fd >= 0) unlink(tmpPath);
+                continue;
+            }
+            objPath = tmpPath;
+        }
+        const string name = path.substr(path.find_last_of('/') + 1);
+        for (ObjLoader loader : loaders) {
+            cout.flush();
+            const pid_t pid = fork();
+            if (pid == 0) {
+                const long residentKB = ResidentKB();
+#ifdef MESH2_COUNT_ALLOCATIONS
+                const size_t allocations = allocationCount;
+#endif
+                // keep the loader quiet
+                cout.setstate(ios::failbit);
+                const double start = glfwGetTime();
+                Mesh mesh;
+                LoadMesh(mesh, objPath.c_str(), 1, loader);
+                const double t = glfwGetTime() - start;
+                rusage usage = {};
+                getrusage(RUSAGE_SELF, &usage);
+                cout.clear();
+                cout << name << "\t" << ObjLoaderString(loader) << "\t"
+                     << t * 1000 << "\t" << usage.ru_maxrss - residentKB
+                     << "\t";
+#ifdef MESH2_COUNT_ALLOCATIONS
+                cout << allocationCount - allocations << endl;
+#else
+                // not counted outside the benchmark build
+                cout << "-" << endl;
+#endif
+                _exit(0);
+            }
+            int status = 0;
+            if (pid < 0 || waitpid(pid, &status, 0) < 0 || status != 0) {
+                cerr << ObjLoaderString(loader) << " failed on " << path
+                     << endl;
+            }
+        }
+        if (objPath != path) unlink(tmpPath);
+    }
+}
+
+// Loads, optimizes and packs the meshes of paths. Runs on a worker thread
+// while the device and pipelines are created, so it reports failure with a
+// scene without meshes and leaves exiting to main.
+Scene LoadScene(const vector<string>& paths, const Options& options) {
+    vector<Mesh> loaded(paths.size());
+    vector<MappedFile> meshCaches(paths.size());
+    vector<MeshView> meshViews(paths.size());
+    bool ok = true;
+    for (size_t i = 0; ok && i != paths.size(); ++i) {
+        ok = LoadMeshCached(meshViews[i], loaded[i], meshCaches[i], paths[i],
+                            options.loadThreads, options.objLoader,
+                            options.optimizations, options.vertexFormat,
+                            options.lodRatios, options.meshCache);
+    }
+    Scene scene;
+    if (ok) BuildScene(scene, meshViews, options.depthPrepass);
+    for (MappedFile& file : meshCaches) UnmapFile(file);
+    return scene;
+}
+
+// The LoadScene worker while main sets up Vulkan. Any exit() of main, e.g.
+// from VK_CHECK, first waits for it through an atexit handler, so that the
+// worker never runs into static destruction.
+future<Scene> sceneLoad;
+
+void WaitForSceneLoad() {
+    if (sceneLoad.valid()) sceneLoad.wait();
 }
 
 //==============================================================================
 //------------------------------------------------------------------------------
 int main(int argc, char const* argv[]) {
+    Options options = ParseOptions(argc, argv);
     assert(glfwInit());
+    if (options.loadScaling) {
+        LoadScaling(options.scenePath.empty()
+                        ? vector<string>{options.meshPath}
+                        : ScenePaths(options.scenePath));
+        glfwTerminate();
+        return 0;
+    }
+    if (!options.loadBenchmarkDir.empty()) {
+        LoadBenchmark(options.loadBenchmarkDir);
+        glfwTerminate();
+        return 0;
+    }
+    // meshlets, levels of detail, quantized vertices and the prepass streams
+    // are all built from a Mesh in host memory, which direct loading skips
+    if (options.directLoad) {
+        cout << "Direct load: one mesh, float vertices, no GPU culling or "
+                "depth prepass"
+             << endl;
+        options.scenePath.clear();
+        options.vertexFormat = VERTEX_FORMAT_FLOAT;
+        options.gpuCulling = false;
+        options.depthPrepass = false;
+    }
+    const vector<string> meshPaths = options.scenePath.empty()
+                                         ? vector<string>{options.meshPath}
+                                         : ScenePaths(options.scenePath);
+    if (meshPaths.empty()) {
+        cerr << "No meshes in " << options.scenePath << endl;
+        exit(1);
+    }
+    // meshes load while the device, swapchain and pipelines are created, the
+    // upload waits for them; direct loading needs the device
+    if (!options.directLoad) {
+        atexit(WaitForSceneLoad);
+        sceneLoad = async(launch::async, LoadScene, meshPaths, options);
+    }
     assert(glfwVulkanSupported() == GLFW_TRUE);
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
     // VK_CHECK(volkInitialize());
@@ -786,26 +3509,65 @@ int main(int argc, char const* argv[]) {
     //     exit(EXIT_FAILURE);
     // }
 
+    const DeviceFeatures supported = QueryDeviceFeatures(physicalDevice);
+    if (options.vertexFormat == VERTEX_FORMAT_QUANTIZED &&
+        !supported.storage16) {
+        cerr << "16 bit storage not supported, using float vertices" << endl;
+        options.vertexFormat = VERTEX_FORMAT_FLOAT;
+    }
+    if (!supported.shaderDrawParameters) {
+        cerr << "Shader draw parameters not supported" << endl;
+        exit(1);
+    }
+    // more than one draw per indirect call needs multiDrawIndirect
+    if (options.gpuCulling &&
+        !(supported.drawIndirectCount && supported.multiDrawIndirect)) {
+        cerr << "Indirect count draws not supported, GPU culling disabled"
+             << endl;
+        options.gpuCulling = false;
+    }
+    options.occlusionCulling = options.occlusionCulling && options.gpuCulling;
+    // culled draws are already indirect
+    options.multiDraw = options.multiDraw && !options.gpuCulling;
+    if (options.multiDraw && !supported.multiDrawIndirect) {
+        cerr << "Multi draw indirect not supported, drawing meshes one by one"
+             << endl;
+        options.multiDraw = false;
+    }
+    const bool quantized = options.vertexFormat == VERTEX_FORMAT_QUANTIZED;
+    DeviceFeatures enabled;
+    enabled.storage16 = quantized;
+    enabled.drawIndirectCount = options.gpuCulling;
+    enabled.multiDrawIndirect = options.gpuCulling || options.multiDraw;
+    enabled.shaderDrawParameters = true;
     VkDevice device =
-        CreateDevice(physicalDevice, uint32_t(graphicsQueueFamily));
+        CreateDevice(physicalDevice, uint32_t(graphicsQueueFamily), enabled);
 
     VkSurfaceKHR surface = CreateSurface(instance, win);
 
-    VkBool32 supported = VK_FALSE;
+    VkBool32 presentSupported = VK_FALSE;
     VK_CHECK(vkGetPhysicalDeviceSurfaceSupportKHR(
-        physicalDevice, graphicsQueueFamily, surface, &supported));
-    assert(supported == VK_TRUE);
+        physicalDevice, graphicsQueueFamily, surface, &presentSupported));
+    assert(presentSupported == VK_TRUE);
+
+    // set by the framebuffer size callback, consumed by the render loop
+    bool resized = false;
+    glfwSetWindowUserPointer(win, &resized);
+    glfwSetFramebufferSizeCallback(win, FramebufferSizeCallback);
 
-    int width = 0;
-    int height = 0;
-    glfwGetWindowSize(win, &width, &height);
     VkRenderPass renderPass = CreateRenderPass(device);
+    // late draws after occlusion culling
+    VkRenderPass loadRenderPass = CreateRenderPass(device, true);
+    const VkPresentModeKHR presentMode =
+        SelectPresentMode(physicalDevice, surface, options.presentMode);
     Swapchain swapchain;
-    CreateSwapchain(swapchain, physicalDevice, device, surface,
-                    graphicsQueueFamily, renderPass);
-
-    VkSemaphore acquireSemaphore = CreateSemaphore(device);
-    VkSemaphore releaseSemaphore = CreateSemaphore(device);
+    const bool rcs = CreateSwapchain(swapchain, physicalDevice, device,
+                                     surface, graphicsQueueFamily, renderPass,
+                                     presentMode, options.imageCount);
+    assert(rcs);
+    vector<RetiredSwapchain> retiredSwapchains;
+    cout << "Present mode: " << PresentModeString(presentMode)
+         << ", swapchain images: " << swapchain.imageCount << endl;
 
     VkQueue queue = VK_NULL_HANDLE;
     vkGetDeviceQueue(device, graphicsQueueFamily, 0, &queue);
@@ -813,69 +3575,416 @@ int main(int argc, char const* argv[]) {
 
     // cmake build path: build/bin/debug|release
     // cmake shaders build path: build/shaders
-    const char* VSPATH = "../../shaders/mesh2.vert.glsl.spv";
+    const char* VSPATH = quantized
+                             ? "../../shaders/mesh2_quantized.vert.glsl.spv"
+                             : "../../shaders/mesh2.vert.glsl.spv";
     const char* FSPATH = "../../shaders/mesh1.frag.glsl.spv";
+    const char* DEPTHVSPATH =
+        quantized ? "../../shaders/mesh2_depth_quantized.vert.glsl.spv"
+                  : "../../shaders/mesh2_depth.vert.glsl.spv";
     VkShaderModule triangleVS = LoadShader(device, VSPATH);
     VkShaderModule triangleFS = LoadShader(device, FSPATH);
+    VkShaderModule depthVS = options.depthPrepass
+                                 ? LoadShader(device, DEPTHVSPATH)
+                                 : VK_NULL_HANDLE;
 
     VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
-    VkPipelineLayout layout = CreatePipelineLayout(device, setLayout);
-    VkPipelineCache cache = VK_NULL_HANDLE;
-    VkPipeline trianglePipeline = CreateGraphicsPipeline(
-        device, cache, renderPass, triangleVS, triangleFS, layout);
+    // vertices, or positions for the prepass, instance transforms, draws and
+    // mesh quantizations
+    VkPipelineLayout layout = CreatePipelineLayout(
+        device, setLayout, sizeof(DrawData),
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER});
+    const string cachePath = ExecutableDir() + "mesh2.pipelinecache";
+    bool warmCache = false;
+    VkPipelineCache cache =
+        LoadPipelineCache(device, physicalDevice, cachePath, warmCache);
+    const double pipelineStart = glfwGetTime();
+    VkPipeline trianglePipeline =
+        CreateGraphicsPipeline(device, cache, renderPass, triangleVS,
+                               triangleFS, layout, options.depthPrepass);
+    VkPipeline depthPipeline =
+        options.depthPrepass
+            ? CreateGraphicsPipeline(device, cache, renderPass, depthVS,
+                                     VK_NULL_HANDLE, layout)
+            : VK_NULL_HANDLE;
+    // meshlets, draw commands, draw counts, meshlet visibility, depth pyramid,
+    // instance transforms, instance levels
+    VkShaderModule cullCS = VK_NULL_HANDLE;
+    VkDescriptorSetLayout cullSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout cullLayout = VK_NULL_HANDLE;
+    VkPipeline cullPipeline = VK_NULL_HANDLE;
+    VkSampler depthSampler = VK_NULL_HANDLE;
+    if (options.gpuCulling) {
+        cullCS = LoadShader(device, "../../shaders/meshlet_cull.comp.glsl.spv");
+        cullLayout = CreatePipelineLayout(
+            device, cullSetLayout, sizeof(CullData),
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+             VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+             VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+             VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+             VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+             VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+             VK_DESCRIPTOR_TYPE_STORAGE_BUFFER},
+            VK_SHADER_STAGE_COMPUTE_BIT);
+        cullPipeline =
+            CreateComputePipeline(device, cache, cullCS, cullLayout);
+        depthSampler = CreateSampler(device);
+    }
+    // source level, destination level
+    VkShaderModule reduceCS = VK_NULL_HANDLE;
+    VkDescriptorSetLayout reduceSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout reduceLayout = VK_NULL_HANDLE;
+    VkPipeline reducePipeline = VK_NULL_HANDLE;
+    if (options.occlusionCulling) {
+        reduceCS =
+            LoadShader(device, "../../shaders/depth_reduce.comp.glsl.spv");
+        reduceLayout = CreatePipelineLayout(
+            device, reduceSetLayout, 0,
+            {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+             VK_DESCRIPTOR_TYPE_STORAGE_IMAGE},
+            VK_SHADER_STAGE_COMPUTE_BIT);
+        reducePipeline =
+            CreateComputePipeline(device, cache, reduceCS, reduceLayout);
+    }
+    cout << "Pipeline creation: " << (glfwGetTime() - pipelineStart) * 1000
+         << " ms (" << (warmCache ? "warm" : "cold") << " cache)" << endl;
 
-    VkCommandPool commandPool = CreateCommandPool(device, graphicsQueueFamily);
-
-    VkCommandBufferAllocateInfo allocInfo = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = commandPool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1};
-    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
-    VK_CHECK(vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer));
+    vector<Frame> frames;
+    CreateFrames(frames, device, graphicsQueueFamily, options.framesInFlight);
 
     VkPhysicalDeviceMemoryProperties memProps;
     vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProps);
-    const char* meshPath = "../../../assets/tmp-data/kitten.obj";
-    Mesh mesh;
-    bool rcm = LoadMesh(mesh, meshPath);
-    assert(rcm);
+    const bool directUpload =
+        !options.forceStaging && DeviceLocalHostVisible(memProps);
+    const VkMemoryPropertyFlags meshMemory =
+        directUpload ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+                     : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    Allocator allocator;
+    CreateAllocator(allocator, device, memProps);
     Buffer vb = {};
-    const size_t BUFSIZE = 128 * 1024 * 1024;
-    CreateBuffer(
-        vb, device, memProps, BUFSIZE,
-        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
     Buffer ib = {};
-    CreateBuffer(
-        ib, device, memProps, BUFSIZE,
-        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-    assert(vb.size >= mesh.vertices.size() * sizeof(Vertex));
-    memcpy(vb.data, mesh.vertices.data(),
-           sizeof(Vertex) * mesh.vertices.size());
-    assert(ib.size >= mesh.indices.size() * sizeof(uint32_t));
-    memcpy(ib.data, mesh.indices.data(),
-           mesh.indices.size() * sizeof(uint32_t));
+    Scene scene;
+    if (options.directLoad) {
+        LoadMeshDirect(scene, vb, ib, meshPaths[0], allocator, directUpload,
+                       queue, uint32_t(graphicsQueueFamily));
+    } else {
+        const double waitStart = glfwGetTime();
+        scene = sceneLoad.get();
+        cout << "Waited " << (glfwGetTime() - waitStart) * 1000
+             << " ms for the meshes" << endl;
+        // loaded before the device turned out to lack 16 bit storage
+        if (!scene.meshes.empty() &&
+            scene.vertexFormat != options.vertexFormat) {
+            scene = LoadScene(meshPaths, options);
+        }
+        if (scene.meshes.empty()) {
+            cerr << "Cannot load the meshes" << endl;
+            exit(1);
+        }
+    }
+    cout << "Packed " << scene.meshes.size() << " meshes" << endl;
+    // meshlet data for cluster culling, next to the vertex storage buffer
+    Buffer mlb = {};
+    Buffer mvb = {};
+    Buffer mtb = {};
+    // position stream and shadow indices of the depth prepass
+    Buffer pb = {};
+    Buffer sib = {};
+    // instance transforms, the instances of each mesh are consecutive and
+    // the camera backs off to see the whole grid
+    Buffer tb = {};
+    vector<Transform> transforms;
+    const uint32_t instanceCount =
+        uint32_t(scene.meshes.size()) * options.instances;
+    const float sceneRadius =
+        MakeInstanceGrid(transforms, instanceCount, scene.radius);
+    const float cameraDistance = max(options.lodDistance, 1.5f * sceneRadius);
+    // position decoding of each mesh
+    Buffer qb = {};
+    vector<Quantization> quantizations;
+    for (const SceneMesh& mesh : scene.meshes) {
+        quantizations.push_back(mesh.quantization);
+    }
+    struct {
+        Buffer& buffer;
+        const void* data;
+        size_t size;
+        VkBufferUsageFlags usage;
+    } uploads[] = {
+        {vb, scene.vertices.data(), scene.vertices.size(),
+         VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT},
+        {ib, scene.indices.data(), sizeof(uint32_t) * scene.indices.size(),
+         VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT},
+        {mlb, scene.meshlets.data(), sizeof(Meshlet) * scene.meshlets.size(),
+         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT},
+        {mvb, scene.meshletVertices.data(),
+         sizeof(uint32_t) * scene.meshletVertices.size(),
+         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT},
+        {mtb, scene.meshletTriangles.data(), scene.meshletTriangles.size(),
+         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT},
+        {pb, scene.positions.data(), scene.positions.size(),
+         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT},
+        {sib, scene.shadowIndices.data(),
+         sizeof(uint32_t) * scene.shadowIndices.size(),
+         VK_BUFFER_USAGE_INDEX_BUFFER_BIT},
+        {tb, transforms.data(), sizeof(Transform) * transforms.size(),
+         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT},
+        {qb, quantizations.data(),
+         sizeof(Quantization) * quantizations.size(),
+         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT}};
+    size_t uploadBytes = 0;
+    size_t largestUpload = 0;
+    for (auto& upload : uploads) {
+        // already filled by direct loading
+        if (upload.buffer.buffer != VK_NULL_HANDLE) continue;
+        // zero sized buffers are invalid
+        CreateBuffer(upload.buffer, allocator,
+                     max(upload.size, sizeof(uint32_t)),
+                     upload.usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     meshMemory);
+        uploadBytes += upload.size;
+        largestUpload = max(largestUpload, upload.size);
+    }
+    Buffer staging = {};
+    VkCommandPool uploadPool = VK_NULL_HANDLE;
+    if (!directUpload) {
+        CreateBuffer(staging, allocator, largestUpload,
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        uploadPool = CreateCommandPool(device, graphicsQueueFamily);
+    }
+    const double uploadStart = glfwGetTime();
+    for (auto& upload : uploads) {
+        if (upload.size == 0) continue;
+        if (directUpload) {
+            memcpy(upload.buffer.data, upload.data, upload.size);
+        } else {
+            UploadBuffer(device, uploadPool, queue, staging, upload.buffer,
+                         upload.data, upload.size);
+        }
+    }
+    const double uploadTime = glfwGetTime() - uploadStart;
+    if (!directUpload) {
+        vkDestroyCommandPool(device, uploadPool, nullptr);
+        DestroyBuffer(staging, allocator);
+    }
+    const double uploadMB = double(uploadBytes) / (1024 * 1024);
+    cout << "Uploaded " << uploadMB << " MB ("
+         << (directUpload ? "direct" : "staging") << ") in "
+         << uploadTime * 1000 << " ms: " << uploadMB / uploadTime << " MB/s"
+         << endl;
+    DrawData drawData = {};
+    const vector<SceneMesh> meshes = move(scene.meshes);
+    const uint32_t meshletCount = uint32_t(scene.meshlets.size());
+    scene = Scene();
+    // level of every instance, picked at its distance
+    vector<uint32_t> currentLods(instanceCount, ~0u);
+    // first flag and flag count of the visibility ranges to clear, those of
+    // the instances whose level changed this frame
+    vector<pair<uint32_t, uint32_t>> visibilityResets;
+    // meshlets of the current levels of all instances
+    uint32_t lodMeshlets = 0;
+
+    // one command per meshlet of the finest level, the largest, and instance
+    // for each of the early and late draws
+    uint32_t maxDraws = 0;
+    for (const SceneMesh& mesh : meshes) {
+        maxDraws += mesh.lods[0].meshletCount * options.instances;
+    }
+    maxDraws = max(maxDraws, 1u);
+    vector<CullTarget> cullTargets(options.gpuCulling ? frames.size() : 0);
+    for (CullTarget& target : cullTargets) {
+        CreateBuffer(target.commands, allocator,
+                     sizeof(MeshDraw) * maxDraws * 2,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        CreateBuffer(target.count, allocator, sizeof(uint32_t) * 2,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        CreateBuffer(target.readback, allocator, sizeof(uint32_t) * 2,
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        CreateBuffer(target.lods, allocator,
+                     sizeof(InstanceLod) * max(instanceCount, 1u),
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+    // without culling, the draws of each frame in flight, at most one per
+    // instance, written by the CPU once the frame's fence signals
+    vector<Buffer> meshDraws(options.gpuCulling ? 0 : frames.size());
+    for (Buffer& buffer : meshDraws) {
+        CreateBuffer(buffer, allocator,
+                     sizeof(MeshDraw) * max(instanceCount, 1u),
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+    uint32_t visibleMeshlets = 0;
+    // one flag per meshlet of every level and instance, shared by all frames
+    // in flight; cleared by the first frame, so everything starts in the late
+    // draws
+    Buffer visibility = {};
+    if (options.gpuCulling) {
+        CreateBuffer(visibility, allocator,
+                     sizeof(uint32_t) *
+                         max(size_t(meshletCount) * options.instances,
+                             size_t(1)),
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
 
     VK_EXT(instance, CmdPushDescriptorSetKHR);
+    PFN_vkCmdDrawIndexedIndirectCountKHR vkCmdDrawIndexedIndirectCountKHR =
+        nullptr;
+    if (options.gpuCulling) {
+        vkCmdDrawIndexedIndirectCountKHR =
+            (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr(
+                device, "vkCmdDrawIndexedIndirectCountKHR");
+        assert(vkCmdDrawIndexedIndirectCountKHR);
+    }
 
+    PrintAllocatorStats(allocator);
+
+    uint64_t frameNumber = 0;
+    double statsStart = glfwGetTime();
+    uint32_t statsFrames = 0;
+    // CPU time spent recording command buffers
+    double recordTime = 0;
     while (!glfwWindowShouldClose(win)) {
         glfwPollEvents();
-        glfwGetWindowSize(win, &width, &height);
-        ResizeSwapchain(swapchain, physicalDevice, device, surface,
-                        graphicsQueueFamily, renderPass, swapchain.swapchain);
+        if (resized) {
+            if (!RecreateSwapchain(swapchain, retiredSwapchains, frameNumber,
+                                   physicalDevice, device, surface,
+                                   graphicsQueueFamily, renderPass)) {
+                // zero sized surface: nothing to present until restored
+                glfwWaitEvents();
+                continue;
+            }
+            resized = false;
+        }
+
+        Frame& frame = frames[frameNumber % frames.size()];
+        // wait for the GPU to retire the last submission that used this slot;
+        // slots are waited on in order, so every earlier frame is done too
+        VK_CHECK(vkWaitForFences(device, 1, &frame.fence, VK_TRUE,
+                                 ~uint64_t(0)));
+        const uint64_t completedFrames =
+            frameNumber >= frames.size() ? frameNumber - frames.size() + 1 : 0;
+        CollectRetiredSwapchains(device, retiredSwapchains, completedFrames);
+        CullTarget* cullTarget =
+            options.gpuCulling ? &cullTargets[frameNumber % frames.size()]
+                               : nullptr;
+        Buffer* drawBuffer = options.gpuCulling
+                                 ? &cullTarget->commands
+                                 : &meshDraws[frameNumber % frames.size()];
+        // result of the last frame culled with this slot
+        if (cullTarget && frameNumber >= frames.size()) {
+            const uint32_t* counts =
+                static_cast<const uint32_t*>(cullTarget->readback.data);
+            const uint32_t visible = counts[0] + counts[1];
+            if (visible != visibleMeshlets) {
+                cout << "Visible meshlets: " << visible << "/" << lodMeshlets
+                     << " (" << counts[0] << " early, " << counts[1]
+                     << " late)" << endl;
+                visibleMeshlets = visible;
+            }
+        }
+
         uint32_t imageIndex = 0;
-        VK_CHECK(vkAcquireNextImageKHR(device, swapchain.swapchain,
-                                       ~uint64_t(0), acquireSemaphore,
-                                       VK_NULL_HANDLE, &imageIndex));
+        const VkResult acquireResult = vkAcquireNextImageKHR(
+            device, swapchain.swapchain, ~uint64_t(0), frame.acquireSemaphore,
+            VK_NULL_HANDLE, &imageIndex);
+        if (acquireResult == VK_ERROR_OUT_OF_DATE_KHR) {
+            resized = true;
+            continue;
+        }
+        // suboptimal still signals the semaphore: render and recreate after
+        // presenting
+        if (acquireResult != VK_SUBOPTIMAL_KHR) VK_CHECK(acquireResult);
 
-        VK_CHECK(vkResetCommandPool(device, commandPool, 0));
+        VK_CHECK(vkResetFences(device, 1, &frame.fence));
+        VK_CHECK(vkResetCommandPool(device, frame.commandPool, 0));
+        VkCommandBuffer commandBuffer = frame.commandBuffer;
 
         VkCommandBufferBeginInfo beginInfo = {
             .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
             .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT};
 
+        const double recordStart = glfwGetTime();
         VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
 
+        // one level per instance, picked at its distance
+        bool lodChanged = false;
+        lodMeshlets = 0;
+        visibilityResets.clear();
+        InstanceLod* instanceLods =
+            cullTarget ? static_cast<InstanceLod*>(cullTarget->lods.data)
+                       : nullptr;
+        for (uint32_t m = 0; m != meshes.size(); ++m) {
+            const SceneMesh& mesh = meshes[m];
+            for (uint32_t i = 0; i != options.instances; ++i) {
+                const uint32_t instance = m * options.instances + i;
+                const uint32_t lodIndex = SelectLod(
+                    mesh.lods,
+                    InstanceDistance(transforms[instance], cameraDistance),
+                    swapchain.height, options.lodThreshold);
+                const uint32_t visibilityOffset =
+                    VisibilityOffset(mesh, options.instances, i);
+                if (lodIndex != currentLods[instance]) {
+                    lodChanged = true;
+                    // the ranges of consecutive instances are adjacent
+                    if (!visibilityResets.empty() &&
+                        visibilityResets.back().first +
+                                visibilityResets.back().second ==
+                            visibilityOffset) {
+                        visibilityResets.back().second += mesh.meshletCount;
+                    } else {
+                        visibilityResets.push_back(
+                            {visibilityOffset, mesh.meshletCount});
+                    }
+                }
+                currentLods[instance] = lodIndex;
+                const MeshLod& lod = mesh.lods[lodIndex];
+                lodMeshlets += lod.meshletCount;
+                if (instanceLods) {
+                    instanceLods[instance] = {
+                        .meshletOffset = lod.meshletOffset,
+                        .meshletCount = lod.meshletCount,
+                        .visibilityOffset = visibilityOffset +
+                                            lod.meshletOffset -
+                                            mesh.meshletOffset};
+                }
+            }
+        }
+        if (lodChanged) {
+            uint32_t lodInstances[MAX_LODS] = {};
+            for (uint32_t lodIndex : currentLods) ++lodInstances[lodIndex];
+            cout << "Instances per LOD:";
+            for (uint32_t count : lodInstances) cout << " " << count;
+            cout << endl;
+        }
+        const Camera camera =
+            MakeCamera(cameraDistance, swapchain.width, swapchain.height);
+        MakeViewProjection(camera, drawData.viewProjection);
+        MeshDraw* draws = static_cast<MeshDraw*>(drawBuffer->data);
+        const uint32_t drawCount =
+            cullTarget ? 0
+                       : MakeMeshDraws(draws, meshes, currentLods,
+                                       options.instances);
+
         VkImageMemoryBarrier renderBeginBarrier = ImageBarrier(
             swapchain.images[imageIndex], 0, VK_IMAGE_LAYOUT_UNDEFINED,
             VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
@@ -887,55 +3996,363 @@ int main(int argc, char const* argv[]) {
                              VK_DEPENDENCY_BY_REGION_BIT, 0, nullptr, 0,
                              nullptr, 1, &renderBeginBarrier);
 
+        // depth and pyramid are shared with the previous frame: make its
+        // depth and pyramid writes available before the layout transitions
+        // discard the contents
+        const VkImageMemoryBarrier depthBeginBarriers[] = {
+            ImageBarrier(swapchain.depth.image,
+                         VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                         VK_IMAGE_LAYOUT_UNDEFINED,
+                         VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                             VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                         VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                         VK_IMAGE_ASPECT_DEPTH_BIT),
+            ImageBarrier(swapchain.depthPyramid.image,
+                         VK_ACCESS_SHADER_WRITE_BIT,
+                         VK_IMAGE_LAYOUT_UNDEFINED,
+                         VK_ACCESS_SHADER_READ_BIT |
+                             VK_ACCESS_SHADER_WRITE_BIT,
+                         VK_IMAGE_LAYOUT_GENERAL)};
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                 VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                 VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 0, nullptr, 0, nullptr,
+                             size(depthBeginBarriers), depthBeginBarriers);
+
+        // Culls the meshlets of the current levels into the draw commands at
+        // drawOffset
+        const auto cullMeshlets = [&](uint32_t flags, uint32_t drawOffset) {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              cullPipeline);
+            const VkDescriptorBufferInfo cullBuffers[] = {
+                {mlb.buffer, 0, mlb.size},
+                {cullTarget->commands.buffer, 0, cullTarget->commands.size},
+                {cullTarget->count.buffer, 0, cullTarget->count.size},
+                {visibility.buffer, 0, visibility.size}};
+            const VkDescriptorBufferInfo instanceBuffers[] = {
+                {tb.buffer, 0, tb.size},
+                {cullTarget->lods.buffer, 0, cullTarget->lods.size}};
+            const VkDescriptorImageInfo pyramidInfo = {
+                depthSampler, swapchain.depthPyramid.view,
+                VK_IMAGE_LAYOUT_GENERAL};
+            VkWriteDescriptorSet
+                cullDescriptors[size(cullBuffers) + 1 + size(instanceBuffers)];
+            for (uint32_t i = 0; i != size(cullBuffers); ++i) {
+                cullDescriptors[i] = {
+                    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstBinding = i,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                    .pBufferInfo = &cullBuffers[i]};
+            }
+            cullDescriptors[size(cullBuffers)] = {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstBinding = size(cullBuffers),
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                .pImageInfo = &pyramidInfo};
+            for (uint32_t i = 0; i != size(instanceBuffers); ++i) {
+                const uint32_t binding = size(cullBuffers) + 1 + i;
+                cullDescriptors[binding] = {
+                    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstBinding = binding,
+                    .dstArrayElement = 0,
+                    .descriptorCount = 1,
+                    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                    .pBufferInfo = &instanceBuffers[i]};
+            }
+            vkCmdPushDescriptorSetKHR(
+                commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullLayout, 0,
+                size(cullDescriptors), cullDescriptors);
+            // enough groups for the finest level, the largest; each instance
+            // skips the meshlets past those of its level
+            for (uint32_t m = 0; m != meshes.size(); ++m) {
+                const CullData cullData =
+                    MakeCullData(camera, meshes[m], m,
+                                 m * options.instances, flags, drawOffset);
+                vkCmdPushConstants(commandBuffer, cullLayout,
+                                   VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                                   sizeof(cullData), &cullData);
+                vkCmdDispatch(commandBuffer,
+                              (meshes[m].lods[0].meshletCount + 63) / 64,
+                              options.instances, 1);
+            }
+
+            const VkBufferMemoryBarrier cullBarriers[] = {
+                // commands, and per draw data for the vertex shaders
+                BufferBarrier(cullTarget->commands.buffer,
+                              VK_ACCESS_SHADER_WRITE_BIT,
+                              VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                                  VK_ACCESS_SHADER_READ_BIT),
+                BufferBarrier(cullTarget->count.buffer,
+                              VK_ACCESS_SHADER_WRITE_BIT,
+                              VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                                  VK_ACCESS_TRANSFER_READ_BIT)};
+            vkCmdPipelineBarrier(commandBuffer,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                                     VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                                     VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 0, 0, nullptr, size(cullBarriers),
+                                 cullBarriers, 0, nullptr);
+        };
+
+        // Reduces the depth of the early draws into the depth pyramid
+        const auto buildDepthPyramid = [&]() {
+            const VkImageMemoryBarrier depthReadBarrier = ImageBarrier(
+                swapchain.depth.image,
+                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                VK_ACCESS_SHADER_READ_BIT,
+                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                VK_IMAGE_ASPECT_DEPTH_BIT);
+            vkCmdPipelineBarrier(commandBuffer,
+                                 VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0,
+                                 nullptr, 0, nullptr, 1, &depthReadBarrier);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              reducePipeline);
+            const Image& pyramid = swapchain.depthPyramid;
+            for (uint32_t level = 0; level != pyramid.levels; ++level) {
+                VkDescriptorImageInfo source = {
+                    depthSampler, swapchain.depth.view,
+                    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+                if (level > 0) {
+                    source.imageView = swapchain.depthPyramidLevels[level - 1];
+                    source.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+                }
+                const VkDescriptorImageInfo destination = {
+                    VK_NULL_HANDLE, swapchain.depthPyramidLevels[level],
+                    VK_IMAGE_LAYOUT_GENERAL};
+                const VkWriteDescriptorSet reduceDescriptors[] = {
+                    {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                     .dstBinding = 0,
+                     .descriptorCount = 1,
+                     .descriptorType =
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                     .pImageInfo = &source},
+                    {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                     .dstBinding = 1,
+                     .descriptorCount = 1,
+                     .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                     .pImageInfo = &destination}};
+                vkCmdPushDescriptorSetKHR(
+                    commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    reduceLayout, 0, size(reduceDescriptors),
+                    reduceDescriptors);
+                const uint32_t width = max(pyramid.width >> level, 1u);
+                const uint32_t height = max(pyramid.height >> level, 1u);
+                vkCmdDispatch(commandBuffer, (width + 7) / 8, (height + 7) / 8,
+                              1);
+                // the next level and the late culling read this one
+                const VkImageMemoryBarrier levelBarrier = ImageBarrier(
+                    pyramid.image, VK_ACCESS_SHADER_WRITE_BIT,
+                    VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_READ_BIT,
+                    VK_IMAGE_LAYOUT_GENERAL);
+                vkCmdPipelineBarrier(commandBuffer,
+                                     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                                     0, nullptr, 0, nullptr, 1,
+                                     &levelBarrier);
+            }
+            // the late draws continue the color and depth of the early ones
+            const VkImageMemoryBarrier attachmentBarriers[] = {
+                ImageBarrier(swapchain.images[imageIndex],
+                             VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                             VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                             VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                                 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                             VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL),
+                ImageBarrier(swapchain.depth.image, VK_ACCESS_SHADER_READ_BIT,
+                             VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                             VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                             VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                             VK_IMAGE_ASPECT_DEPTH_BIT)};
+            vkCmdPipelineBarrier(
+                commandBuffer,
+                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                    VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                    VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                0, 0, nullptr, 0, nullptr, size(attachmentBarriers),
+                attachmentBarriers);
+        };
+
+        const uint32_t cullFlags =
+            (options.coneCulling ? CULL_CONE : 0) |
+            (options.occlusionCulling ? CULL_OCCLUSION : 0);
+        if (cullTarget) {
+            // the previous user of the count buffer is the indirect draw and
+            // readback copy of frames.size() frames ago, ordered by the fence
+            vkCmdFillBuffer(commandBuffer, cullTarget->count.buffer, 0,
+                            cullTarget->count.size, 0);
+            // the flags of a level are stale once another level was drawn:
+            // test all of its meshlets in the late pass again
+            if (frameNumber == 0) {
+                vkCmdFillBuffer(commandBuffer, visibility.buffer, 0,
+                                visibility.size, 0);
+            } else {
+                for (const auto& [first, count] : visibilityResets) {
+                    vkCmdFillBuffer(commandBuffer, visibility.buffer,
+                                    sizeof(uint32_t) * first,
+                                    sizeof(uint32_t) * count, 0);
+                }
+            }
+            // visibility was last written by the previous late culling
+            const VkBufferMemoryBarrier clearBarriers[] = {
+                BufferBarrier(cullTarget->count.buffer,
+                              VK_ACCESS_TRANSFER_WRITE_BIT,
+                              VK_ACCESS_SHADER_READ_BIT |
+                                  VK_ACCESS_SHADER_WRITE_BIT),
+                BufferBarrier(visibility.buffer,
+                              VK_ACCESS_TRANSFER_WRITE_BIT |
+                                  VK_ACCESS_SHADER_WRITE_BIT,
+                              VK_ACCESS_SHADER_READ_BIT |
+                                  VK_ACCESS_SHADER_WRITE_BIT)};
+            vkCmdPipelineBarrier(commandBuffer,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT |
+                                     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0,
+                                 nullptr, size(clearBarriers), clearBarriers,
+                                 0, nullptr);
+            cullMeshlets(cullFlags, 0);
+        }
+
         VkClearColorValue color = {48.f / 255.f, 10.f / 255.f, 36.f / 255.f, 1};
-        VkClearValue clearColor = {.color = color};
+        // reverse-Z: 0 is infinitely far
+        VkClearValue clearValues[2] = {{.color = color},
+                                       {.depthStencil = {0, 0}}};
+
+        // Early draws clear the attachments. With occlusion culling, the
+        // meshlets that were hidden last frame are tested against the depth
+        // of the early draws and the survivors drawn on top.
+        const uint32_t passCount = options.occlusionCulling ? 2 : 1;
+        for (uint32_t pass = 0; pass != passCount; ++pass) {
+            if (pass == 1) {
+                buildDepthPyramid();
+                cullMeshlets(cullFlags | CULL_LATE, maxDraws);
+            }
 
-        VkRenderPassBeginInfo passBeginInfo = {
-            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
-        passBeginInfo.renderPass = renderPass;
-        passBeginInfo.framebuffer = swapchain.framebuffers[imageIndex];
-        passBeginInfo.renderArea.extent.width = swapchain.width;
-        passBeginInfo.renderArea.extent.height = swapchain.height;
-        passBeginInfo.clearValueCount = 1,
-        passBeginInfo.pClearValues = &clearColor;
+            VkRenderPassBeginInfo passBeginInfo = {
+                .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+            passBeginInfo.renderPass = pass == 0 ? renderPass : loadRenderPass;
+            passBeginInfo.framebuffer = swapchain.framebuffers[imageIndex];
+            passBeginInfo.renderArea.extent.width = swapchain.width;
+            passBeginInfo.renderArea.extent.height = swapchain.height;
+            passBeginInfo.clearValueCount = size(clearValues),
+            passBeginInfo.pClearValues = clearValues;
+
+            //-------------------------------------------------
+            vkCmdBeginRenderPass(commandBuffer, &passBeginInfo,
+                                 VK_SUBPASS_CONTENTS_INLINE);
+
+            VkViewport viewport = {.x = 0,
+                                   .y = float(swapchain.height),
+                                   .width = float(swapchain.width),
+                                   .height = -float(swapchain.height),
+                                   .minDepth = 0,
+                                   .maxDepth = 1};
+            VkRect2D scissor = {.offset = {0, 0},
+                                .extent = {swapchain.width, swapchain.height}};
+
+            vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+            vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+            // DRAW CALLS HERE!!!
+            drawData.drawOffset = cullTarget ? maxDraws * pass : 0;
+            vkCmdPushConstants(commandBuffer, layout,
+                               VK_SHADER_STAGE_VERTEX_BIT, 0,
+                               sizeof(drawData), &drawData);
+            // the prepass lays down depth from the position stream, then
+            // shading runs once per visible fragment
+            const uint32_t stepCount = options.depthPrepass ? 2 : 1;
+            for (uint32_t step = 0; step != stepCount; ++step) {
+                const bool prepass = step + 1 < stepCount;
+                vkCmdBindPipeline(commandBuffer,
+                                  VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                  prepass ? depthPipeline : trianglePipeline);
+
+                const Buffer& vertexBuffer = prepass ? pb : vb;
+                VkDescriptorBufferInfo bufferInfo[] = {
+                    {.buffer = vertexBuffer.buffer,
+                     .offset = 0,
+                     .range = vertexBuffer.size},
+                    {.buffer = tb.buffer, .offset = 0, .range = tb.size},
+                    {.buffer = drawBuffer->buffer,
+                     .offset = 0,
+                     .range = drawBuffer->size},
+                    {.buffer = qb.buffer, .offset = 0, .range = qb.size}};
+
+                VkWriteDescriptorSet descriptors[size(bufferInfo)];
+                for (uint32_t i = 0; i != size(descriptors); ++i) {
+                    descriptors[i] = {
+                        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                        .dstBinding = i,
+                        .dstArrayElement = 0,
+                        .descriptorCount = 1,
+                        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                        .pBufferInfo = &bufferInfo[i]};
+                }
+
+                vkCmdPushDescriptorSetKHR(
+                    commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0,
+                    size(descriptors), descriptors);
+
+                // shadow indices share the layout of the index buffer
+                vkCmdBindIndexBuffer(commandBuffer,
+                                     prepass ? sib.buffer : ib.buffer, 0,
+                                     VK_INDEX_TYPE_UINT32);
+                // vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+                if (cullTarget) {
+                    // one draw per visible meshlet and instance, each a range
+                    // of the lod indices
+                    vkCmdDrawIndexedIndirectCountKHR(
+                        commandBuffer, cullTarget->commands.buffer,
+                        sizeof(MeshDraw) * drawData.drawOffset,
+                        cullTarget->count.buffer, sizeof(uint32_t) * pass,
+                        maxDraws, sizeof(MeshDraw));
+                } else if (options.multiDraw) {
+                    // all meshes in one draw
+                    vkCmdDrawIndexedIndirect(commandBuffer, drawBuffer->buffer,
+                                             0, drawCount, sizeof(MeshDraw));
+                } else {
+                    // the instances of a mesh at one level in one draw, which
+                    // reads its MeshDraw at drawOffset
+                    for (uint32_t d = 0; d != drawCount; ++d) {
+                        const VkDrawIndexedIndirectCommand& c =
+                            draws[d].command;
+                        vkCmdPushConstants(commandBuffer, layout,
+                                           VK_SHADER_STAGE_VERTEX_BIT,
+                                           offsetof(DrawData, drawOffset),
+                                           sizeof(uint32_t), &d);
+                        vkCmdDrawIndexed(commandBuffer, c.indexCount,
+                                         c.instanceCount, c.firstIndex,
+                                         c.vertexOffset, c.firstInstance);
+                    }
+                }
+            }
+            vkCmdEndRenderPass(commandBuffer);
+        }
 
-        //-------------------------------------------------
-        vkCmdBeginRenderPass(commandBuffer, &passBeginInfo,
-                             VK_SUBPASS_CONTENTS_INLINE);
-
-        VkViewport viewport = {.x = 0,
-                               .y = float(height),
-                               .width = float(width),
-                               .height = -float(height)};
-        VkRect2D scissor = {.offset = {0, 0},
-                            .extent = {uint32_t(width), uint32_t(height)}};
-
-        vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
-        // DRAW CALLS HERE!!!
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          trianglePipeline);
-
-        VkDescriptorBufferInfo bufferInfo = {
-            .buffer = vb.buffer, .offset = 0, .range = vb.size};
-
-        VkWriteDescriptorSet descriptors[1];
-        descriptors[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptors[0].dstBinding = 0;
-        descriptors[0].descriptorCount = 1;
-        descriptors[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        descriptors[0].pBufferInfo = &bufferInfo;
-        descriptors[0].dstArrayElement = 0;
-
-        vkCmdPushDescriptorSetKHR(commandBuffer,
-                                  VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0,
-                                  size(descriptors), descriptors);
-
-        vkCmdBindIndexBuffer(commandBuffer, ib.buffer, 0, VK_INDEX_TYPE_UINT32);
-        // vkCmdDraw(commandBuffer, 3, 1, 0, 0);
-        vkCmdDrawIndexed(commandBuffer, uint32_t(mesh.indices.size()), 1, 0, 0,
-                         0);
-        vkCmdEndRenderPass(commandBuffer);
+        if (cullTarget) {
+            const VkBufferCopy countCopy = {0, 0, cullTarget->count.size};
+            vkCmdCopyBuffer(commandBuffer, cullTarget->count.buffer,
+                            cullTarget->readback.buffer, 1, &countCopy);
+            const VkBufferMemoryBarrier readbackBarrier =
+                BufferBarrier(cullTarget->readback.buffer,
+                              VK_ACCESS_TRANSFER_WRITE_BIT,
+                              VK_ACCESS_HOST_READ_BIT);
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
+                                 &readbackBarrier, 0, nullptr);
+        }
         //-------------------------------------------------
 
         // Not needed because clear color set in render pass
@@ -957,50 +4374,118 @@ int main(int argc, char const* argv[]) {
             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0,
             nullptr, 0, nullptr, 1, &renderEndBarrier);
         VK_CHECK(vkEndCommandBuffer(commandBuffer));
+        recordTime += glfwGetTime() - recordStart;
 
         VkPipelineStageFlags submitStageMask =
             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 
-        VkSubmitInfo submitInfo = {.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                                   .waitSemaphoreCount = 1,
-                                   .pWaitSemaphores = &acquireSemaphore,
-                                   .pWaitDstStageMask = &submitStageMask,
-                                   .commandBufferCount = 1,
-                                   .pCommandBuffers = &commandBuffer,
-                                   .signalSemaphoreCount = 1,
-                                   .pSignalSemaphores = &releaseSemaphore};
+        VkSubmitInfo submitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &frame.acquireSemaphore,
+            .pWaitDstStageMask = &submitStageMask,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &commandBuffer,
+            .signalSemaphoreCount = 1,
+            .pSignalSemaphores = &frame.releaseSemaphore};
 
-        VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
+        VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, frame.fence));
 
         VkPresentInfoKHR presentInfo = {
             .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
             .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &releaseSemaphore,
+            .pWaitSemaphores = &frame.releaseSemaphore,
             .swapchainCount = 1,
             .pSwapchains = &swapchain.swapchain,
             .pImageIndices = &imageIndex};
 
-        VK_CHECK(vkQueuePresentKHR(queue, &presentInfo));
-
-        VK_CHECK(vkDeviceWaitIdle(device));
-        // VK_CHECK(vkQueueWaitIdle(queue));
+        const VkResult presentResult = vkQueuePresentKHR(queue, &presentInfo);
+        ++frameNumber;
+        if (frameNumber == 1) {
+            // glfw time starts at glfwInit, right at the start of main
+            cout << "First frame after " << glfwGetTime() * 1000 << " ms ("
+                 << (warmCache ? "warm" : "cold") << " pipeline cache)"
+                 << endl;
+        }
+        if (presentResult == VK_SUBOPTIMAL_KHR ||
+            presentResult == VK_ERROR_OUT_OF_DATE_KHR) {
+            resized = true;
+        } else {
+            VK_CHECK(presentResult);
+        }
 
-        // TODO: remove when we switch to desktop compute
-        glfwWaitEvents();
+        if (!options.continuous) {
+            glfwWaitEvents();
+            continue;
+        }
+        ++statsFrames;
+        const double now = glfwGetTime();
+        if (now - statsStart >= 1.0) {
+            const double fps = statsFrames / (now - statsStart);
+            char title[160];
+            int n = snprintf(title, sizeof(title),
+                             "vulkan - %s - %.1f fps %.3f ms - record %.3f ms",
+                             PresentModeString(presentMode), fps, 1000.0 / fps,
+                             1000.0 * recordTime / statsFrames);
+            if (options.gpuCulling) {
+                snprintf(title + n, sizeof(title) - n,
+                         " - %u/%u meshlets visible", visibleMeshlets,
+                         lodMeshlets);
+            }
+            glfwSetWindowTitle(win, title);
+            statsStart = now;
+            statsFrames = 0;
+            recordTime = 0;
+        }
     }
 
     VK_CHECK(vkDeviceWaitIdle(device));
-    DestroyBuffer(vb, device);
-    DestroyBuffer(ib, device);
-    vkDestroyCommandPool(device, commandPool, nullptr);
+    for (CullTarget& target : cullTargets) {
+        DestroyBuffer(target.commands, allocator);
+        DestroyBuffer(target.count, allocator);
+        DestroyBuffer(target.readback, allocator);
+        DestroyBuffer(target.lods, allocator);
+    }
+    for (Buffer& buffer : meshDraws) DestroyBuffer(buffer, allocator);
+    if (options.gpuCulling) DestroyBuffer(visibility, allocator);
+    DestroyBuffer(vb, allocator);
+    DestroyBuffer(ib, allocator);
+    DestroyBuffer(mlb, allocator);
+    DestroyBuffer(mvb, allocator);
+    DestroyBuffer(mtb, allocator);
+    DestroyBuffer(pb, allocator);
+    DestroyBuffer(sib, allocator);
+    DestroyBuffer(tb, allocator);
+    DestroyBuffer(qb, allocator);
+    DestroyAllocator(allocator);
+    DestroyFrames(device, frames);
+    CollectRetiredSwapchains(device, retiredSwapchains, frameNumber);
     DestroySwapchain(device, swapchain);
     vkDestroyPipeline(device, trianglePipeline, nullptr);
+    if (options.depthPrepass) {
+        vkDestroyPipeline(device, depthPipeline, nullptr);
+        vkDestroyShaderModule(device, depthVS, nullptr);
+    }
+    if (options.gpuCulling) {
+        vkDestroyPipeline(device, cullPipeline, nullptr);
+        vkDestroyPipelineLayout(device, cullLayout, nullptr);
+        vkDestroyDescriptorSetLayout(device, cullSetLayout, nullptr);
+        vkDestroyShaderModule(device, cullCS, nullptr);
+        vkDestroySampler(device, depthSampler, nullptr);
+    }
+    if (options.occlusionCulling) {
+        vkDestroyPipeline(device, reducePipeline, nullptr);
+        vkDestroyPipelineLayout(device, reduceLayout, nullptr);
+        vkDestroyDescriptorSetLayout(device, reduceSetLayout, nullptr);
+        vkDestroyShaderModule(device, reduceCS, nullptr);
+    }
+    SavePipelineCache(device, cache, cachePath);
+    vkDestroyPipelineCache(device, cache, nullptr);
     vkDestroyPipelineLayout(device, layout, nullptr);
     vkDestroyShaderModule(device, triangleVS, nullptr);
     vkDestroyShaderModule(device, triangleFS, nullptr);
     vkDestroyRenderPass(device, renderPass, nullptr);
-    vkDestroySemaphore(device, releaseSemaphore, nullptr);
-    vkDestroySemaphore(device, acquireSemaphore, nullptr);
+    vkDestroyRenderPass(device, loadRenderPass, nullptr);
     vkDestroySurfaceKHR(instance, surface, nullptr);
     vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
     glfwDestroyWindow(win);
@@ -0,0 +1,29 @@
+#version 450
+
+#pragma shader_stage(compute)
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// previous pyramid level, or the depth buffer for level 0
+layout(binding = 0) uniform sampler2D source;
+
+layout(binding = 1, r32f) uniform writeonly image2D destination;
+
+void main() {
+  ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+  ivec2 destinationSize = imageSize(destination);
+  if (p.x >= destinationSize.x || p.y >= destinationSize.y) return;
+  ivec2 sourceSize = textureSize(source, 0);
+  // source texels covered by p: 2x2 between levels, up to 3x3 from a depth
+  // buffer that is not a power of two
+  ivec2 first = p * sourceSize / destinationSize;
+  ivec2 last = ((p + 1) * sourceSize - 1) / destinationSize;
+  // reverse-Z: the farthest depth is the smallest
+  float depth = 1;
+  for (int y = first.y; y <= last.y; ++y) {
+    for (int x = first.x; x <= last.x; ++x) {
+      depth = min(depth, texelFetch(source, ivec2(x, y), 0).x);
+    }
+  }
+  imageStore(destination, p, vec4(depth));
+}
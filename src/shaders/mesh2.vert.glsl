@@ -1,4 +1,5 @@
 #version 450
+#extension GL_ARB_shader_draw_parameters : require
 
 #pragma shader_stage(vertex)
 
@@ -13,13 +14,58 @@ layout(binding = 0) /*readonly*/ buffer Vertices
   Vertex vertices[];
 };
 
+// Transform in mesh2.cpp, mesh to world space rows
+struct Transform {
+  vec4 rows[3];
+};
+
+layout(binding = 1) readonly buffer Transforms
+{
+  Transform transforms[];
+};
+
+// MeshDraw in mesh2.cpp: an indexed indirect command followed by per draw data
+struct MeshDraw {
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int vertexOffset;
+  uint firstInstance;
+  uint transformOffset;
+  uint meshIndex;
+};
+
+layout(binding = 2) readonly buffer MeshDraws
+{
+  MeshDraw draws[];
+};
+
+// DrawData in mesh2.cpp
+layout(push_constant) uniform DrawData
+{
+  mat4 viewProjection;
+  uint drawOffset;
+};
+
 layout(location = 0) out vec4 color; 
 
+// shared with the depth prepass, which must produce the same depth
+invariant gl_Position;
+
 void main() {
   Vertex v = vertices[gl_VertexIndex];
   vec3 position = vec3(v.vx, v.vy, v.vz);
   vec3 normal = vec3(v.nx, v.ny, v.nz);
   vec2 texCoord = vec2(v.tu, v.tv);
-  gl_Position = vec4(position + vec3(0, 0, 0.5), 1.0);
+  uint transform = draws[drawOffset + gl_DrawIDARB].transformOffset;
+  Transform t = transforms[transform + gl_InstanceIndex];
+  vec4 local = vec4(position, 1.0);
+  vec3 world = vec3(dot(t.rows[0], local), dot(t.rows[1], local),
+                    dot(t.rows[2], local));
+  gl_Position = viewProjection * vec4(world, 1.0);
+  // rotation and uniform scale only
+  normal = normalize(vec3(dot(t.rows[0].xyz, normal),
+                          dot(t.rows[1].xyz, normal),
+                          dot(t.rows[2].xyz, normal)));
   color = vec4(normal * 0.5 + vec3(0.5), 1.0);
 }
@@ -0,0 +1,57 @@
+#version 450
+#extension GL_ARB_shader_draw_parameters : require
+
+#pragma shader_stage(vertex)
+
+// position stream, three floats per vertex
+layout(binding = 0) readonly buffer Positions
+{
+  float positions[];
+};
+
+// Transform in mesh2.cpp, mesh to world space rows
+struct Transform {
+  vec4 rows[3];
+};
+
+layout(binding = 1) readonly buffer Transforms
+{
+  Transform transforms[];
+};
+
+// MeshDraw in mesh2.cpp: an indexed indirect command followed by per draw data
+struct MeshDraw {
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int vertexOffset;
+  uint firstInstance;
+  uint transformOffset;
+  uint meshIndex;
+};
+
+layout(binding = 2) readonly buffer MeshDraws
+{
+  MeshDraw draws[];
+};
+
+// DrawData in mesh2.cpp
+layout(push_constant) uniform DrawData
+{
+  mat4 viewProjection;
+  uint drawOffset;
+};
+
+// must match mesh2.vert.glsl
+invariant gl_Position;
+
+void main() {
+  uint i = gl_VertexIndex * 3;
+  vec3 position = vec3(positions[i], positions[i + 1], positions[i + 2]);
+  uint transform = draws[drawOffset + gl_DrawIDARB].transformOffset;
+  Transform t = transforms[transform + gl_InstanceIndex];
+  vec4 local = vec4(position, 1.0);
+  vec3 world = vec3(dot(t.rows[0], local), dot(t.rows[1], local),
+                    dot(t.rows[2], local));
+  gl_Position = viewProjection * vec4(world, 1.0);
+}
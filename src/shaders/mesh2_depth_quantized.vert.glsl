@@ -0,0 +1,78 @@
+#version 450
+
+#extension GL_EXT_shader_16bit_storage : require
+#extension GL_ARB_shader_draw_parameters : require
+
+#pragma shader_stage(vertex)
+
+// position stream, the position of QuantizedVertex in mesh2.cpp
+struct Position {
+  uint16_t vx, vy, vz, vw;
+};
+
+layout(binding = 0) readonly buffer Positions
+{
+  Position positions[];
+};
+
+// Transform in mesh2.cpp, mesh to world space rows
+struct Transform {
+  vec4 rows[3];
+};
+
+layout(binding = 1) readonly buffer Transforms
+{
+  Transform transforms[];
+};
+
+// MeshDraw in mesh2.cpp: an indexed indirect command followed by per draw data
+struct MeshDraw {
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int vertexOffset;
+  uint firstInstance;
+  uint transformOffset;
+  uint meshIndex;
+};
+
+layout(binding = 2) readonly buffer MeshDraws
+{
+  MeshDraw draws[];
+};
+
+// Quantization in mesh2.cpp: position = offset + scale * unorm16
+struct Quantization {
+  vec4 offset;
+  vec4 scale;
+};
+
+layout(binding = 3) readonly buffer Quantizations
+{
+  Quantization quantizations[];
+};
+
+// DrawData in mesh2.cpp
+layout(push_constant) uniform DrawData
+{
+  mat4 viewProjection;
+  uint drawOffset;
+};
+
+// must match mesh2_quantized.vert.glsl
+invariant gl_Position;
+
+void main() {
+  // read in place like mesh2_quantized.vert.glsl, with the same expression
+  uint i = gl_VertexIndex;
+  MeshDraw draw = draws[drawOffset + gl_DrawIDARB];
+  Quantization q = quantizations[draw.meshIndex];
+  vec3 position = q.offset.xyz + q.scale.xyz * vec3(uint(positions[i].vx),
+                                                    uint(positions[i].vy),
+                                                    uint(positions[i].vz));
+  Transform t = transforms[draw.transformOffset + gl_InstanceIndex];
+  vec4 local = vec4(position, 1.0);
+  vec3 world = vec3(dot(t.rows[0], local), dot(t.rows[1], local),
+                    dot(t.rows[2], local));
+  gl_Position = viewProjection * vec4(world, 1.0);
+}
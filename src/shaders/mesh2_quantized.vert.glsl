@@ -0,0 +1,97 @@
+#version 450
+
+#extension GL_EXT_shader_16bit_storage : require
+#extension GL_ARB_shader_draw_parameters : require
+
+#pragma shader_stage(vertex)
+
+// matches QuantizedVertex in mesh2.cpp
+struct Vertex {
+  uint16_t vx, vy, vz, vw;
+  uint normal;
+  float16_t tu, tv;
+};
+
+layout(binding = 0) readonly buffer Vertices
+{
+  Vertex vertices[];
+};
+
+// Transform in mesh2.cpp, mesh to world space rows
+struct Transform {
+  vec4 rows[3];
+};
+
+layout(binding = 1) readonly buffer Transforms
+{
+  Transform transforms[];
+};
+
+// MeshDraw in mesh2.cpp: an indexed indirect command followed by per draw data
+struct MeshDraw {
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int vertexOffset;
+  uint firstInstance;
+  uint transformOffset;
+  uint meshIndex;
+};
+
+layout(binding = 2) readonly buffer MeshDraws
+{
+  MeshDraw draws[];
+};
+
+// Quantization in mesh2.cpp: position = offset + scale * unorm16
+struct Quantization {
+  vec4 offset;
+  vec4 scale;
+};
+
+layout(binding = 3) readonly buffer Quantizations
+{
+  Quantization quantizations[];
+};
+
+// DrawData in mesh2.cpp
+layout(push_constant) uniform DrawData
+{
+  mat4 viewProjection;
+  uint drawOffset;
+};
+
+layout(location = 0) out vec4 color;
+
+// shared with the depth prepass, which must produce the same depth
+invariant gl_Position;
+
+vec3 octDecode(vec2 e) {
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  float t = max(-n.z, 0.0);
+  n.xy += mix(vec2(t), vec2(-t), greaterThanEqual(n.xy, vec2(0.0)));
+  return normalize(n);
+}
+
+void main() {
+  // 16 bit members are read in place: storage only 16 bit support allows no
+  // 16 bit locals
+  uint i = gl_VertexIndex;
+  MeshDraw draw = draws[drawOffset + gl_DrawIDARB];
+  Quantization q = quantizations[draw.meshIndex];
+  vec3 position = q.offset.xyz + q.scale.xyz * vec3(uint(vertices[i].vx),
+                                                    uint(vertices[i].vy),
+                                                    uint(vertices[i].vz));
+  vec3 normal = octDecode(unpackSnorm2x16(vertices[i].normal));
+  vec2 texCoord = vec2(float(vertices[i].tu), float(vertices[i].tv));
+  Transform t = transforms[draw.transformOffset + gl_InstanceIndex];
+  vec4 local = vec4(position, 1.0);
+  vec3 world = vec3(dot(t.rows[0], local), dot(t.rows[1], local),
+                    dot(t.rows[2], local));
+  gl_Position = viewProjection * vec4(world, 1.0);
+  // rotation and uniform scale only
+  normal = normalize(vec3(dot(t.rows[0].xyz, normal),
+                          dot(t.rows[1].xyz, normal),
+                          dot(t.rows[2].xyz, normal)));
+  color = vec4(normal * 0.5 + vec3(0.5), 1.0);
+}
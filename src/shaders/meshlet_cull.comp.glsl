@@ -0,0 +1,184 @@
+#version 450
+
+#pragma shader_stage(compute)
+
+layout(local_size_x = 64) in;
+
+// matches Meshlet in mesh2.cpp
+struct Meshlet {
+  float cx, cy, cz, radius;
+  float ax, ay, az, coneCutoff;
+  float nx, ny, nz;
+  uint indexOffset;
+  uint vertexOffset, triangleOffset;
+  uint vertexCount, triangleCount;
+};
+
+// MeshDraw in mesh2.cpp: an indexed indirect command followed by per draw data
+struct MeshDraw {
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int vertexOffset;
+  uint firstInstance;
+  uint transformOffset;
+  uint meshIndex;
+};
+
+layout(binding = 0) readonly buffer Meshlets
+{
+  Meshlet meshlets[];
+};
+
+layout(binding = 1) writeonly buffer MeshDraws
+{
+  MeshDraw draws[];
+};
+
+// early and late draws
+layout(binding = 2) buffer DrawCount
+{
+  uint drawCount[2];
+};
+
+// 1 if the meshlet passed the last late test, per meshlet of every level and
+// instance
+layout(binding = 3) buffer MeshletVisibility
+{
+  uint meshletVisibility[];
+};
+
+// farthest, i.e. smallest reverse-Z, depth per texel
+layout(binding = 4) uniform sampler2D depthPyramid;
+
+// Transform in mesh2.cpp, mesh to world space rows
+struct Transform {
+  vec4 rows[3];
+};
+
+layout(binding = 5) readonly buffer Transforms
+{
+  Transform transforms[];
+};
+
+// InstanceLod in mesh2.cpp: the meshlets of the level an instance draws and
+// the visibility flag of the first one
+struct InstanceLod {
+  uint meshletOffset;
+  uint meshletCount;
+  uint visibilityOffset;
+};
+
+layout(binding = 6) readonly buffer InstanceLods
+{
+  InstanceLod instanceLods[];
+};
+
+// matches CullFlags in mesh2.cpp
+const uint CULL_CONE = 1;
+const uint CULL_OCCLUSION = 2;
+const uint CULL_LATE = 4;
+
+// Camera and CullData in mesh2.cpp: the camera is distance units in front of
+// the world origin, view = world + (0, 0, distance), looking down +z with
+// reverse-Z, depth = znear / z. Workgroup y is the instance of the mesh.
+layout(push_constant) uniform CullData
+{
+  float P00, P11, znear, distance;
+  vec4 frustum;
+  uint flags;
+  uint drawOffset;
+  int vertexOffset;
+  uint firstInstance;
+  uint meshIndex;
+};
+
+// mesh to view space
+vec3 ToView(Transform t, vec3 position) {
+  vec4 p = vec4(position, 1.0);
+  return vec3(dot(t.rows[0], p), dot(t.rows[1], p),
+              dot(t.rows[2], p) + distance);
+}
+
+// Screen space bounds of a view space sphere, as uv min/max; false when it
+// crosses the near plane. 2D Polyhedral Bounds of a Clipped, Perspective-
+// Projected 3D Sphere, Mara and McGuire 2013.
+bool ProjectSphere(vec3 c, float r, out vec4 uv) {
+  if (c.z < r + znear) return false;
+  vec3 cr = c * r;
+  float czr2 = c.z * c.z - r * r;
+  float vx = sqrt(c.x * c.x + czr2);
+  float minx = (vx * c.x - cr.z) / (vx * c.z + cr.x);
+  float maxx = (vx * c.x + cr.z) / (vx * c.z - cr.x);
+  float vy = sqrt(c.y * c.y + czr2);
+  float miny = (vy * c.y - cr.z) / (vy * c.z + cr.y);
+  float maxy = (vy * c.y + cr.z) / (vy * c.z - cr.y);
+  // the viewport flips y
+  uv = vec4(minx * P00, -maxy * P11, maxx * P00, -miny * P11) * 0.5 + 0.5;
+  return true;
+}
+
+bool Occluded(vec3 center, float radius) {
+  vec4 uv;
+  if (!ProjectSphere(center, radius, uv)) return false;
+  uv = clamp(uv, 0, 1);
+  float nearest = znear / (center.z - radius);
+  // smallest level where the bounds cover at most 2x2 texels
+  vec2 size = vec2(textureSize(depthPyramid, 0));
+  vec2 extent = (uv.zw - uv.xy) * size;
+  int level = int(ceil(log2(max(max(extent.x, extent.y), 1))));
+  level = min(level, textureQueryLevels(depthPyramid) - 1);
+  ivec2 levelSize = textureSize(depthPyramid, level);
+  ivec2 first = min(ivec2(uv.xy * vec2(levelSize)), levelSize - 1);
+  ivec2 last = min(ivec2(uv.zw * vec2(levelSize)), levelSize - 1);
+  float depth = min(
+      min(texelFetch(depthPyramid, first, level).x,
+          texelFetch(depthPyramid, ivec2(last.x, first.y), level).x),
+      min(texelFetch(depthPyramid, ivec2(first.x, last.y), level).x,
+          texelFetch(depthPyramid, last, level).x));
+  return nearest < depth;
+}
+
+void main() {
+  uint instance = firstInstance + gl_WorkGroupID.y;
+  InstanceLod lod = instanceLods[instance];
+  uint i = gl_GlobalInvocationID.x;
+  if (i >= lod.meshletCount) return;
+  uint index = lod.meshletOffset + i;
+  uint visibilityIndex = lod.visibilityOffset + i;
+  bool late = (flags & CULL_LATE) != 0;
+  bool occlusion = (flags & CULL_OCCLUSION) != 0;
+  // the early pass draws what was visible last frame, the late pass tests
+  // everything against the depth of the early draws
+  if (occlusion && !late && meshletVisibility[visibilityIndex] == 0) return;
+  Meshlet m = meshlets[index];
+  Transform t = transforms[instance];
+  // rotation and uniform scale only
+  float scale = length(vec3(t.rows[0].x, t.rows[1].x, t.rows[2].x));
+  vec3 center = ToView(t, vec3(m.cx, m.cy, m.cz));
+  float radius = m.radius * scale;
+  // the infinite far plane never culls
+  bool visible = center.z * frustum.y - abs(center.x) * frustum.x > -radius;
+  visible = visible &&
+            center.z * frustum.w - abs(center.y) * frustum.z > -radius;
+  visible = visible && center.z + radius > znear;
+  // every triangle faces away from the viewer
+  if ((flags & CULL_CONE) != 0) {
+    vec3 apex = ToView(t, vec3(m.ax, m.ay, m.az));
+    vec3 axis = vec3(dot(t.rows[0].xyz, vec3(m.nx, m.ny, m.nz)),
+                     dot(t.rows[1].xyz, vec3(m.nx, m.ny, m.nz)),
+                     dot(t.rows[2].xyz, vec3(m.nx, m.ny, m.nz))) / scale;
+    visible = visible && dot(normalize(apex), axis) < m.coneCutoff;
+  }
+  if (occlusion && late) {
+    visible = visible && !Occluded(center, radius);
+    bool drawn = meshletVisibility[visibilityIndex] != 0;
+    meshletVisibility[visibilityIndex] = visible ? 1 : 0;
+    if (drawn) return;
+  }
+  if (!visible) return;
+  uint slot = drawOffset + atomicAdd(drawCount[late ? 1 : 0], 1);
+  // the vertex shader finds the instance through gl_DrawIDARB
+  draws[slot] = MeshDraw(m.triangleCount * 3, 1, m.indexOffset, vertexOffset,
+                         0, instance, meshIndex);
+}
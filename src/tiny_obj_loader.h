@@ -620,6 +620,44 @@ bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
              MaterialReader *readMatFn = NULL, bool triangulate = true,
              bool default_vcols_fallback = true);
 
+/// Loads .obj from a memory buffer, parsing it on `num_threads` threads.
+/// The buffer is split at line boundaries into chunks which are parsed
+/// concurrently, then merged with relative (negative) indices fixed up to the
+/// same values `LoadObj` would produce.
+/// Only `v`, `vn`, `vt` and `f` records are handled: materials, groups,
+/// vertex colors, lines and points are ignored and all faces are returned in
+/// a single shape. Polygons are fan triangulated when `triangulate` is true.
+/// Lines are tokenized in place without copies or allocations, so `buf` may
+/// be a memory mapped file and need not be nul terminated. With one thread
+/// the whole buffer is parsed on the calling thread. A counting pre-scan
+/// sizes the output arrays once, which chunks are then parsed straight into.
+/// Returns true when loading .obj become success.
+/// Returns warning message into `warn`, and error message into `err`
+bool LoadObjParallel(attrib_t *attrib, std::vector<shape_t> *shapes,
+                     std::string *warn, std::string *err, const char *buf,
+                     size_t len, unsigned int num_threads,
+                     bool triangulate = true);
+
+/// Same as above, reading the whole file into memory first.
+bool LoadObjParallel(attrib_t *attrib, std::vector<shape_t> *shapes,
+                     std::string *warn, std::string *err, const char *filename,
+                     unsigned int num_threads, bool triangulate = true);
+
+/// Record counts of an .obj, see CountObj().
+struct obj_counts_t {
+  size_t num_vertices;   // `v' records
+  size_t num_normals;    // `vn' records
+  size_t num_texcoords;  // `vt' records
+  size_t num_faces;      // faces kept by LoadObjParallel, or their triangles
+  size_t num_indices;    // vertices of those faces or triangles
+};
+
+/// Counts the records of an .obj in memory without parsing them, as the
+/// pre-scan of LoadObjParallel does. Lets callers size their buffers once
+/// before streaming the file through `LoadObjWithCallback`.
+void CountObj(obj_counts_t *counts, const char *buf, size_t len,
+              bool triangulate = true);
+
 /// Loads materials into std::map
 void LoadMtl(std::map<std::string, int> *material_map,
              std::vector<material_t> *materials, std::istream *inStream,
@@ -643,6 +681,8 @@ bool ParseTextureNameAndOption(std::string *texname, texture_option_t *texopt,
 #endif  // TINY_OBJ_LOADER_H_
 
 #ifdef TINYOBJLOADER_IMPLEMENTATION
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cmath>
@@ -652,8 +692,13 @@ bool ParseTextureNameAndOption(std::string *texname, texture_option_t *texopt,
 #include <fstream>
 #include <limits>
 #include <sstream>
+#include <thread>
 #include <utility>
 
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+
 namespace tinyobj {
 
 MaterialReader::~MaterialReader() {}
@@ -3049,6 +3094,454 @@ bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
   return true;
 }
 
+// Token parsers of the buffer loaders. Each takes the end of the line and never
+// reads past it, so lines are parsed in place inside the (possibly memory
+// mapped) buffer: no copy, no nul terminator and no allocation per line.
+static inline const char *skipSpace(const char *p, const char *end) {
+  while (p < end && IS_SPACE(*p)) p++;
+  return p;
+}
+
+static inline real_t parseReal(const char **token, const char *end) {
+  const char *p = skipSpace(*token, end);
+  const char *e = p;
+  while (e < end && !IS_SPACE(*e)) e++;
+  real_t val = 0;
+#if defined(__cpp_lib_to_chars)
+  // from_chars does not take a '+' sign and leaves val alone on failure
+  std::from_chars(p < e && *p == '+' ? p + 1 : p, e, val);
+#else
+  double d;
+  if (tryParseDouble(p, e, &d)) val = static_cast<real_t>(d);
+#endif
+  (*token) = e;
+  return val;
+}
+
+// atoi() stopping at `end', leaves the token at the next '/' or space.
+static inline int parseIndex(const char **token, const char *end) {
+  const char *p = (*token);
+  const bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) p++;
+  int i = 0;
+  while (p < end && IS_DIGIT(*p)) {
+    i = i * 10 + (*p - '0');
+    p++;
+  }
+  while (p < end && *p != '/' && !IS_SPACE(*p)) p++;
+  (*token) = p;
+  return negative ? -i : i;
+}
+
+// parseRawTriple() stopping at `end'.
+static vertex_index_t parseRawTriple(const char **token, const char *end) {
+  vertex_index_t vi(static_cast<int>(0));  // 0 is an invalid index in OBJ
+
+  vi.v_idx = parseIndex(token, end);
+  if ((*token) == end || (*token)[0] != '/') {
+    return vi;
+  }
+  (*token)++;
+
+  // i//k
+  if ((*token) < end && (*token)[0] == '/') {
+    (*token)++;
+    vi.vn_idx = parseIndex(token, end);
+    return vi;
+  }
+
+  // i/j/k or i/j
+  vi.vt_idx = parseIndex(token, end);
+  if ((*token) == end || (*token)[0] != '/') {
+    return vi;
+  }
+
+  // i/j/k
+  (*token)++;  // skip '/'
+  vi.vn_idx = parseIndex(token, end);
+  return vi;
+}
+
+// Record kinds handled by the buffer loaders.
+enum obj_record_t { OBJ_OTHER, OBJ_V, OBJ_VN, OBJ_VT, OBJ_F };
+
+// Kind of the record starting at token, n characters long. The pre-scan and
+// the parser classify lines through here so that their counts agree.
+static inline obj_record_t objRecord(const char *token, size_t n) {
+  if (n > 1 && token[0] == 'v' && IS_SPACE((token[1]))) return OBJ_V;
+  if (n > 2 && token[0] == 'v' && IS_SPACE((token[2]))) {
+    if (token[1] == 'n') return OBJ_VN;
+    if (token[1] == 't') return OBJ_VT;
+  }
+  if (n > 1 && token[0] == 'f' && IS_SPACE((token[1]))) return OBJ_F;
+  return OBJ_OTHER;
+}
+
+// Returns the line at *p with leading spaces skipped, sets *line_end to its
+// end without "\r\n" and advances *p to the next line.
+static inline const char *nextLine(const char **p, const char *end,
+                                   const char **line_end) {
+  const char *eol =
+      static_cast<const char *>(memchr(*p, '\n', size_t(end - *p)));
+  if (!eol) {
+    eol = end;
+  }
+  (*line_end) = eol;
+  if (eol > (*p) && eol[-1] == '\r') {
+    (*line_end)--;
+  }
+  const char *token = skipSpace(*p, *line_end);
+  (*p) = eol + 1;
+  return token;
+}
+
+// Number of space separated words in [p, end), i.e. vertices of an `f' record.
+static inline size_t countWords(const char *p, const char *end) {
+  size_t n = 0;
+  for (p = skipSpace(p, end); p < end; p = skipSpace(p, end)) {
+    n++;
+    while (p < end && !IS_SPACE(*p)) p++;
+  }
+  return n;
+}
+
+// Faces of npolys vertices kept by the buffer loaders. The pre-scan and the
+// parser both decide through here so that their counts agree.
+static inline bool keepFace(size_t npolys, bool triangulate) {
+  // Face must have 3+ vertices. Untriangulated, the count must also fit the
+  // unsigned char of num_face_vertices.
+  return npolys >= 3 && (triangulate || npolys <= 255);
+}
+
+// Per chunk state of LoadObjParallel. A pre-scan counts the records of every
+// chunk, which sizes the output arrays once and gives each chunk its offsets
+// into them: chunks are then parsed straight into place, without per chunk
+// buffers or a merge copy.
+struct obj_chunk_t {
+  // records, filled by countObjChunk()
+  size_t num_v;
+  size_t num_vn;
+  size_t num_vt;
+  size_t num_indices;
+  size_t num_faces;
+  size_t num_lines;
+
+  // offsets into the output arrays, in records
+  size_t v_base;
+  size_t vn_base;
+  size_t vt_base;
+  size_t index_base;
+  size_t face_base;
+  size_t line_base;
+
+  size_t num_skipped_faces;  // by keepFace()
+  size_t error_line;         // chunk local, 0 = no error
+  bool out_of_bounds;
+
+  obj_chunk_t()
+      : num_v(0), num_vn(0), num_vt(0), num_indices(0), num_faces(0),
+        num_lines(0), v_base(0), vn_base(0), vt_base(0), index_base(0),
+        face_base(0), line_base(0), num_skipped_faces(0), error_line(0),
+        out_of_bounds(false) {}
+};
+
+// Runs fn(0) ... fn(count - 1) on `num_threads` threads.
+template <typename Fn>
+static void parallelFor(unsigned int num_threads, size_t count, Fn fn) {
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      fn(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned int t = 1; t < num_threads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+}
+
+// Pre-scan: counts the records of a chunk. Lines are found with memchr(),
+// which the C library vectorizes, and only the first characters of a line
+// are looked at but for `f' records, whose words are counted.
+static void countObjChunk(obj_chunk_t *chunk, const char *begin,
+                          const char *end, bool triangulate) {
+  const char *p = begin;
+  while (p < end) {
+    const char *line_end;
+    const char *token = nextLine(&p, end, &line_end);
+    chunk->num_lines++;
+
+    switch (objRecord(token, size_t(line_end - token))) {
+      case OBJ_V:
+        chunk->num_v++;
+        break;
+      case OBJ_VN:
+        chunk->num_vn++;
+        break;
+      case OBJ_VT:
+        chunk->num_vt++;
+        break;
+      case OBJ_F: {
+        const size_t npolys = countWords(token + 2, line_end);
+        if (!keepFace(npolys, triangulate)) break;
+        chunk->num_faces += triangulate ? npolys - 2 : 1;
+        chunk->num_indices += triangulate ? 3 * (npolys - 2) : npolys;
+        break;
+      }
+      case OBJ_OTHER:
+        break;
+    }
+  }
+}
+
+// Resolves an index of a `f' record against the n attributes preceding it in
+// the whole buffer; optional attributes may be absent.
+static inline bool fixChunkIndex(int idx, size_t n, size_t total,
+                                 bool optional, int *ret) {
+  if (idx == 0 && optional) {
+    (*ret) = -1;  // attribute not present
+    return true;
+  }
+  return fixIndex(idx, static_cast<int>(n), ret) && (*ret) >= 0 &&
+         size_t(*ret) < total;
+}
+
+// Parses a chunk into the output arrays at the offsets of the pre-scan.
+static void parseObjChunk(obj_chunk_t *chunk, const char *begin,
+                          const char *end, bool triangulate, attrib_t *attrib,
+                          mesh_t *mesh) {
+  real_t *v = attrib->vertices.data() + 3 * chunk->v_base;
+  real_t *vn = attrib->normals.data() + 3 * chunk->vn_base;
+  real_t *vt = attrib->texcoords.data() + 2 * chunk->vt_base;
+  index_t *indices = mesh->indices.data() + chunk->index_base;
+  unsigned char *num_face_vertices =
+      mesh->num_face_vertices.data() + chunk->face_base;
+  const size_t total_v = attrib->vertices.size() / 3;
+  const size_t total_vn = attrib->normals.size() / 3;
+  const size_t total_vt = attrib->texcoords.size() / 2;
+  size_t num_v = chunk->v_base;
+  size_t num_vn = chunk->vn_base;
+  size_t num_vt = chunk->vt_base;
+  size_t line = 0;
+
+  std::vector<vertex_index_t> face;
+
+  const char *p = begin;
+  while (p < end) {
+    const char *line_end;
+    const char *token = nextLine(&p, end, &line_end);
+    line++;
+
+    switch (objRecord(token, size_t(line_end - token))) {
+      case OBJ_V:
+        token += 2;
+        *v++ = parseReal(&token, line_end);
+        *v++ = parseReal(&token, line_end);
+        *v++ = parseReal(&token, line_end);
+        num_v++;
+        break;
+      case OBJ_VN:
+        token += 3;
+        *vn++ = parseReal(&token, line_end);
+        *vn++ = parseReal(&token, line_end);
+        *vn++ = parseReal(&token, line_end);
+        num_vn++;
+        break;
+      case OBJ_VT:
+        token += 3;
+        *vt++ = parseReal(&token, line_end);
+        *vt++ = parseReal(&token, line_end);
+        num_vt++;
+        break;
+      case OBJ_F: {
+        // one vertex per word, as counted by the pre-scan
+        face.clear();
+        for (token = skipSpace(token + 2, line_end); token < line_end;
+             token = skipSpace(token, line_end)) {
+          face.push_back(parseRawTriple(&token, line_end));
+          while (token < line_end && !IS_SPACE(*token)) token++;
+        }
+
+        const size_t npolys = face.size();
+        if (!keepFace(npolys, triangulate)) {
+          chunk->num_skipped_faces++;
+          break;
+        }
+
+        const size_t nverts = triangulate ? 3 * (npolys - 2) : npolys;
+        for (size_t k = 0; k < nverts; k++) {
+          // fan (0, i + 1, i + 2) for triangle i
+          size_t corner = k;
+          if (triangulate) {
+            corner = (k % 3 == 0) ? 0 : (k / 3 + k % 3);
+          }
+          const vertex_index_t &vi = face[corner];
+          index_t &idx = *indices++;
+          if (vi.v_idx == 0) {
+            chunk->error_line = line;
+            return;
+          }
+          if (!fixChunkIndex(vi.v_idx, num_v, total_v, false,
+                             &idx.vertex_index) ||
+              !fixChunkIndex(vi.vn_idx, num_vn, total_vn, true,
+                             &idx.normal_index) ||
+              !fixChunkIndex(vi.vt_idx, num_vt, total_vt, true,
+                             &idx.texcoord_index)) {
+            chunk->out_of_bounds = true;
+            return;
+          }
+        }
+        if (triangulate) {
+          std::fill(num_face_vertices, num_face_vertices + npolys - 2, 3);
+          num_face_vertices += npolys - 2;
+        } else {
+          *num_face_vertices++ = static_cast<unsigned char>(npolys);
+        }
+        break;
+      }
+      case OBJ_OTHER:
+        // Other records are not supported by the parallel loader.
+        break;
+    }
+  }
+}
+
+bool LoadObjParallel(attrib_t *attrib, std::vector<shape_t> *shapes,
+                     std::string *warn, std::string *err, const char *buf,
+                     size_t len, unsigned int num_threads, bool triangulate) {
+  attrib->vertices.clear();
+  attrib->vertex_weights.clear();
+  attrib->normals.clear();
+  attrib->texcoords.clear();
+  attrib->texcoord_ws.clear();
+  attrib->colors.clear();
+  attrib->skin_weights.clear();
+  shapes->clear();
+
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+
+  // A few chunks per thread to balance uneven line lengths.
+  const size_t num_chunks =
+      std::max(size_t(1), std::min(size_t(num_threads) * 4, len / 4096));
+  std::vector<const char *> bounds(num_chunks + 1);
+  bounds[0] = buf;
+  bounds[num_chunks] = buf + len;
+  for (size_t i = 1; i < num_chunks; i++) {
+    const char *p = std::max(buf + len * i / num_chunks, bounds[i - 1]);
+    const char *eol = static_cast<const char *>(
+        memchr(p, '\n', size_t(buf + len - p)));
+    bounds[i] = eol ? eol + 1 : buf + len;
+  }
+
+  std::vector<obj_chunk_t> chunks(num_chunks);
+  parallelFor(num_threads, num_chunks, [&](size_t i) {
+    countObjChunk(&chunks[i], bounds[i], bounds[i + 1], triangulate);
+  });
+
+  // Offsets of every chunk into the output arrays.
+  obj_chunk_t total;
+  for (size_t i = 0; i < num_chunks; i++) {
+    obj_chunk_t &c = chunks[i];
+    c.v_base = total.num_v;
+    c.vn_base = total.num_vn;
+    c.vt_base = total.num_vt;
+    c.index_base = total.num_indices;
+    c.face_base = total.num_faces;
+    c.line_base = total.num_lines;
+    total.num_v += c.num_v;
+    total.num_vn += c.num_vn;
+    total.num_vt += c.num_vt;
+    total.num_indices += c.num_indices;
+    total.num_faces += c.num_faces;
+    total.num_lines += c.num_lines;
+  }
+
+  attrib->vertices.resize(3 * total.num_v);
+  attrib->normals.resize(3 * total.num_vn);
+  attrib->texcoords.resize(2 * total.num_vt);
+  shapes->resize(1);
+  mesh_t &mesh = (*shapes)[0].mesh;
+  mesh.indices.resize(total.num_indices);
+  mesh.num_face_vertices.resize(total.num_faces);
+  mesh.material_ids.assign(total.num_faces, -1);
+  mesh.smoothing_group_ids.assign(total.num_faces, 0);
+
+  parallelFor(num_threads, num_chunks, [&](size_t i) {
+    parseObjChunk(&chunks[i], bounds[i], bounds[i + 1], triangulate, attrib,
+                  &mesh);
+  });
+
+  for (size_t i = 0; i < num_chunks; i++) {
+    const obj_chunk_t &c = chunks[i];
+    if (c.error_line) {
+      if (err) {
+        std::stringstream ss;
+        ss << "Failed parse `f' line(e.g. zero value for face index. line "
+           << c.line_base + c.error_line << ".)\n";
+        (*err) += ss.str();
+      }
+      return false;
+    }
+    if (c.out_of_bounds) {
+      if (err) {
+        (*err) += "Vertex indices out of bounds.\n";
+      }
+      return false;
+    }
+    total.num_skipped_faces += c.num_skipped_faces;
+  }
+
+  if (total.num_skipped_faces && warn) {
+    std::stringstream ss;
+    ss << total.num_skipped_faces << " face(s) with less than 3 vertices"
+       << (triangulate ? "" : " or more than 255") << " ignored.\n";
+    (*warn) += ss.str();
+  }
+
+  return true;
+}
+
+bool LoadObjParallel(attrib_t *attrib, std::vector<shape_t> *shapes,
+                     std::string *warn, std::string *err, const char *filename,
+                     unsigned int num_threads, bool triangulate) {
+  std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+  if (!ifs) {
+    if (err) {
+      std::stringstream ss;
+      ss << "Cannot open file [" << filename << "]\n";
+      (*err) = ss.str();
+    }
+    return false;
+  }
+  std::vector<char> buf(static_cast<size_t>(ifs.tellg()));
+  ifs.seekg(0, std::ios::beg);
+  if (!ifs.read(buf.data(), static_cast<std::streamsize>(buf.size()))) {
+    if (err) {
+      (*err) = "Failed to read file.\n";
+    }
+    return false;
+  }
+  return LoadObjParallel(attrib, shapes, warn, err, buf.data(), buf.size(),
+                         num_threads, triangulate);
+}
+
+void CountObj(obj_counts_t *counts, const char *buf, size_t len,
+              bool triangulate) {
+  obj_chunk_t chunk;
+  countObjChunk(&chunk, buf, buf + len, triangulate);
+  counts->num_vertices = chunk.num_v;
+  counts->num_normals = chunk.num_vn;
+  counts->num_texcoords = chunk.num_vt;
+  counts->num_faces = chunk.num_faces;
+  counts->num_indices = chunk.num_indices;
+}
+
 bool ObjReader::ParseFromFile(const std::string &filename,
                               const ObjReaderConfig &config) {
   std::string mtl_search_path;